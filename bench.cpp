@@ -0,0 +1,511 @@
+// Self-play benchmark: runs the server in this process and drives four
+// automatic players per table over loopback from a single epoll loop.
+// Reports deals per second, move latency (a card sent -> the next TRICK
+// or TAKEN of its table received), the server's CPU time per deal and
+// its heap allocations per frame sent, and per move once every table has
+// finished its first deal (setting up the connections is left out). With -r players drop their
+// connections at random and come back, which stresses the catch-up paths
+// (best run in a make SANITIZE=thread build). They ask for tokens and come
+// back with RESUME and their token unless -i is given, then they use IAM.
+// A WRONG, or BUSY to a player joining at the start, fails the run; -l
+// keeps the server's log for kierki-replay. make tsan-test does all that.
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "server_main.h"
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    // allocations made by the server's threads (all but the players' one) while counting
+    std::atomic<bool> counting{false};
+    std::atomic<uint64_t> server_allocations{0};
+    thread_local bool players_thread = false;
+
+    void count_allocation() noexcept {
+        if (!players_thread && counting.load(std::memory_order_relaxed))
+            server_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    struct bench_config {
+        size_t tables = 8;
+        size_t deals = 20; // per table
+        size_t loops = 0;
+        size_t acceptors = 1;
+        unsigned seed = 1;
+        double reconnect = 0; // chance of dropping the connection on TRICK or TAKEN
+        bool resume = true; // ask for tokens and come back with RESUME, not IAM
+        bool cork = false;
+        std::string filename; // empty - random deals
+        std::string log_file = "/dev/null"; // of the server
+    };
+
+    [[noreturn]] void usage() {
+        fatal("possible options:\n"
+              "\t\t-n <value> number of tables (optional, default: 8)\n"
+              "\t\t-d <value> deals per table (optional, default: 20)\n"
+              "\t\t-e <value> server event loops (optional, default: 0 - thread per player)\n"
+              "\t\t-a <value> server acceptor threads (optional, default: 1)\n"
+              "\t\t-s <value> seed of random deals (optional, default: 1)\n"
+              "\t\t-f <value> deal file (optional, default: random deals)\n"
+              "\t\t-r <value> chance of a player reconnecting on TRICK or TAKEN (optional, default: 0)\n"
+              "\t\t-i join and reconnect with IAM, without tokens (optional)\n"
+              "\t\t-c cork bursts of messages (optional)\n"
+              "\t\t-l <value> server log file, for kierki-replay (optional, default: none)\n");
+    }
+
+    bench_config get_bench_config(int argc, char *argv[]) {
+        bench_config ans;
+        int opt;
+        while ((opt = getopt(argc, argv, "n:d:e:a:s:f:r:icl:")) != -1) {
+            switch (opt) {
+                case 'n':
+                    if (std::stoi(optarg) <= 0)
+                        usage();
+                    ans.tables = std::stoul(optarg);
+                    break;
+                case 'd':
+                    if (std::stoi(optarg) <= 0)
+                        usage();
+                    ans.deals = std::stoul(optarg);
+                    break;
+                case 'e':
+                    if (std::stoi(optarg) < 0)
+                        usage();
+                    ans.loops = std::stoul(optarg);
+                    break;
+                case 'a':
+                    if (std::stoi(optarg) <= 0)
+                        usage();
+                    ans.acceptors = std::stoul(optarg);
+                    break;
+                case 's':
+                    ans.seed = std::stoul(optarg);
+                    break;
+                case 'f':
+                    ans.filename = optarg;
+                    break;
+                case 'r':
+                    ans.reconnect = std::stod(optarg);
+                    if (ans.reconnect < 0 || ans.reconnect >= 1)
+                        usage();
+                    break;
+                case 'i':
+                    ans.resume = false;
+                    break;
+                case 'c':
+                    ans.cork = true;
+                    break;
+                case 'l':
+                    ans.log_file = optarg;
+                    break;
+                default:
+                    usage();
+            }
+        }
+        return ans;
+    }
+
+    // writes random deals to a temporary file, returns its name
+    std::string random_deals(size_t deals, unsigned seed) {
+        char name[] = "/tmp/kierki-bench-XXXXXX";
+        int fd = mkstemp(name);
+        if (fd == -1)
+            syserr("mkstemp");
+        close(fd);
+        std::mt19937 rng(seed);
+        std::vector<Card> deck;
+        for (int suit = 0; suit < 4; suit++)
+            for (int value = 0; value < 13; value++)
+                deck.emplace_back(value, suit);
+        std::ofstream out(name);
+        for (size_t i = 0; i < deals; i++) {
+            std::shuffle(deck.begin(), deck.end(), rng);
+            out << static_cast<char>('1' + rng() % 7) << get_seat_from_index(static_cast<int>(rng() % 4)) << '\n';
+            for (int pos = 0; pos < 4; pos++)
+                out << cards_to_string(std::vector<Card>(deck.begin() + 13 * pos, deck.begin() + 13 * (pos + 1))) << '\n';
+        }
+        return name;
+    }
+
+    struct Player {
+        SendData send_data;
+        size_t table;
+        char seat;
+        Hand hand;
+        bool open = true;
+        bool busy = false; // got BUSY, tries again
+        uint64_t token = 0;
+        bool answered = false; // got TOKEN, BUSY or DEAL
+        bool first = true; // joined at the start, not reconnected
+        bool dealt = false; // got DEAL or STATE
+        // Results::left at its last three TAKENs not caught up on, oldest first.
+        // A WRONG comes before the TAKEN after the card's trick, and a player
+        // leaving that pauses the trick leaves after the TAKEN two tricks before.
+        std::array<size_t, 3> left_at_taken{};
+        bool catching_up = false; // reconnected, not asked for a card yet
+        Player(int fd, const sockaddr_storage &address, const sockaddr_storage &server_address,
+               size_t table, char seat) :
+            send_data(fd, address, server_address), table(table), seat(seat) {}
+    };
+
+    struct Results {
+        std::vector<int64_t> latencies; // ns
+        size_t frames = 0; // received from the server
+        size_t reconnects = 0;
+        size_t catch_up_frames = 0; // received after reconnecting, before TRICK or SCORE
+        size_t busy = 0;
+        size_t left = 0; // players that dropped their connections
+        size_t wrong = 0; // to cards sent while a table was paused
+        size_t seated = 0; // players joined at the start that got DEAL
+        size_t scores = 0; // players that got a SCORE
+        // server allocations and moves once every player got its first SCORE
+        uint64_t warm_allocations = 0;
+        size_t warm_moves = 0;
+    };
+
+    // -1 if the server doesn't accept connections
+    int connect_to(int port, sockaddr_storage &address, sockaddr_storage &server_address) {
+        addrinfo hints{}, *info;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo("localhost", std::to_string(port).c_str(), &hints, &info) != 0)
+            syserr("cannot get server info");
+        int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (fd < 0)
+            syserr("cannot create a socket");
+        if (connect(fd, info->ai_addr, info->ai_addrlen) == -1) {
+            close(fd);
+            freeaddrinfo(info);
+            return -1;
+        }
+        memcpy(&server_address, info->ai_addr, info->ai_addrlen);
+        freeaddrinfo(info);
+        auto addr_size = static_cast<socklen_t>(sizeof address);
+        if (getsockname(fd, (sockaddr *) &address, &addr_size))
+            syserr("getsockname");
+        return fd;
+    }
+
+    // plays like kierki-klient -a: lowest card of the suit led, else lowest card
+    void handle(Player &p, const Message &msg, std::vector<Clock::time_point> &moves, Results &results) {
+        if ((msg.type == TRICK || msg.type == TAKEN) && moves[p.table] != Clock::time_point{}) {
+            results.latencies.push_back((Clock::now() - moves[p.table]).count());
+            moves[p.table] = {};
+        }
+        if (msg.type == TRICK || msg.type == SCORE)
+            p.catching_up = false;
+        else if (p.catching_up && msg.type != TOKEN)
+            results.catch_up_frames++;
+        switch (msg.type) {
+            case DEAL:
+            case STATE:
+                p.answered = true;
+                if (p.first && !std::exchange(p.dealt, true))
+                    results.seated++;
+                p.hand = Hand();
+                for (size_t i = 0; i < msg.cards_no; i++)
+                    p.hand.add(msg.cards[i]);
+                break;
+            case TRICK: {
+                Card c = msg.cards_no > 0 && p.hand.has_suit(msg.cards[0].get_suit()) ?
+                    p.hand.lowest(msg.cards[0].get_suit()) : p.hand.first();
+                moves[p.table] = Clock::now();
+                send_TRICK(p.send_data, msg.number, std::vector<Card>{c});
+                break;
+            }
+            case TAKEN:
+                if (!p.catching_up)
+                    p.left_at_taken = {p.left_at_taken[1], p.left_at_taken[2], results.left};
+                for (size_t i = 0; i < msg.cards_no; i++)
+                    p.hand.remove(msg.cards[i]);
+                break;
+            case WRONG:
+                // the players only send cards they were asked for, but one of the table leaving
+                // pauses the game, and a card sent then is refused and asked for again on resume
+                if (results.left == p.left_at_taken[0])
+                    fatal("server answered a card with WRONG");
+                results.wrong++;
+                break;
+            case BUSY:
+                // nobody reconnects before every table is full, so every seat is free at the start
+                if (p.first)
+                    fatal("server answered BUSY to a player joining at the start");
+                p.busy = true;
+                p.answered = true;
+                break;
+            case TOKEN:
+                p.token = msg.token;
+                p.answered = true;
+                break;
+            default:
+                break;
+        }
+    }
+
+    // a new connection for seat at table, which has sent RESUME with token
+    // (0 asks for a new seat) or IAM if not resume; nullptr if the server is gone
+    std::unique_ptr<Player> join(int port, size_t table, char seat, bool resume, uint64_t token = 0) {
+        sockaddr_storage address{}, server_address{};
+        int fd = connect_to(port, address, server_address);
+        if (fd == -1)
+            return nullptr;
+        auto p = std::make_unique<Player>(fd, address, server_address, table, seat);
+        Frame hello = resume ? frame_token("RESUME", seat, token) : Frame();
+        if (!resume)
+            hello << "IAM" << seat << "\r\n";
+        if (writen(p->send_data, hello.data(), hello.size()) != static_cast<ssize_t>(hello.size()))
+            syserr("sending IAM");
+        return p;
+    }
+
+    class Game {
+    private:
+        std::vector<std::unique_ptr<Player>> &players;
+        const int port;
+        const double reconnect;
+        const bool resume;
+        std::mt19937 rng;
+        const int epoll_fd;
+        size_t open;
+        std::vector<size_t> rejoining; // players that got BUSY
+        std::vector<bool> scored; // got a SCORE, by player
+
+        void watch(size_t i) {
+            epoll_event ev{.events = EPOLLIN, .data = {.u64 = i}};
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, players[i]->send_data.get_fd(), &ev) == -1)
+                syserr("epoll_ctl");
+        }
+
+        void drop(size_t i) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, players[i]->send_data.get_fd(), nullptr);
+            close(players[i]->send_data.get_fd());
+            players[i]->open = false;
+        }
+
+        // false if the game is over
+        bool rejoin(size_t i, Results &results) {
+            auto p = join(port, players[i]->table, players[i]->seat, resume, players[i]->token);
+            if (p == nullptr)
+                return false;
+            results.reconnects++;
+            p->first = false;
+            p->token = players[i]->token;
+            p->catching_up = true;
+            players[i] = std::move(p);
+            watch(i);
+            return true;
+        }
+    public:
+        Game(std::vector<std::unique_ptr<Player>> &players, int port, double reconnect, bool resume,
+             unsigned seed) :
+            players(players), port(port), reconnect(reconnect), resume(resume), rng(seed),
+            epoll_fd(epoll_create1(0)), open(players.size()), scored(players.size()) {
+            if (epoll_fd == -1)
+                syserr("epoll_create1");
+            for (size_t i = 0; i < players.size(); i++)
+                watch(i);
+        }
+        ~Game() {
+            close(epoll_fd);
+        }
+
+        void play(size_t tables, Results &results) {
+            std::vector<Clock::time_point> moves(tables);
+            std::bernoulli_distribution leaves(reconnect);
+            std::string line;
+            Message msg;
+            epoll_event events[64];
+            while (open > 0) {
+                // the seat of a BUSY player gets free once the server notices the old connection is gone
+                int n = epoll_wait(epoll_fd, events, 64, rejoining.empty() ? -1 : 1);
+                for (size_t i: std::exchange(rejoining, {}))
+                    if (!rejoin(i, results))
+                        open--;
+                for (int k = 0; k < n; k++) {
+                    size_t i = events[k].data.u64;
+                    Player &p = *players[i];
+                    if (!p.open)
+                        continue;
+                    ssize_t nread = p.send_data.receive();
+                    bool left = false;
+                    while (nread > 0 && !left && p.send_data.take_line(line) != 0) {
+                        parse_message(line, msg);
+                        results.frames++;
+                        // a reconnecting player could take the seat of one still joining elsewhere
+                        left = (msg.type == TRICK || msg.type == TAKEN) && reconnect > 0 &&
+                               results.seated == players.size() && leaves(rng);
+                        if (!left)
+                            handle(p, msg, moves, results);
+                        // a fast table gets through many deals before a slow one finishes its first
+                        if (msg.type == SCORE && !scored[i]) {
+                            scored[i] = true;
+                            if (++results.scores == players.size()) {
+                                results.warm_allocations = server_allocations.load();
+                                results.warm_moves = results.latencies.size();
+                            }
+                        }
+                    }
+                    if (left) {
+                        results.left++;
+                        drop(i);
+                        if (!rejoin(i, results))
+                            open--;
+                    }
+                    else if (nread <= 0) {
+                        // the game can't be over before the first players sit, so the server refused
+                        // one (the rest would wait for its table forever)
+                        if (!p.answered && p.first)
+                            fatal("server closed a connection before answering IAM");
+                        drop(i);
+                        if (p.busy) {
+                            results.busy++;
+                            rejoining.push_back(i);
+                        }
+                        else
+                            open--;
+                    }
+                }
+            }
+        }
+    };
+
+    double cpu_seconds(clockid_t clock) {
+        timespec t{};
+        clock_gettime(clock, &t);
+        return static_cast<double>(t.tv_sec) + static_cast<double>(t.tv_nsec) / 1e9;
+    }
+
+    double percentile(std::vector<int64_t> &v, double p) {
+        if (v.empty())
+            return 0;
+        auto k = static_cast<size_t>(p * static_cast<double>(v.size() - 1));
+        std::nth_element(v.begin(), v.begin() + static_cast<ssize_t>(k), v.end());
+        return static_cast<double>(v[k]) / 1000;
+    }
+}
+
+// every allocation goes through these, so the server's can be counted
+// (not inlined: GCC would match the free()s against new expressions)
+[[gnu::noinline]] void *operator new(size_t size) {
+    count_allocation();
+    if (void *p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void *operator new(size_t size, std::align_val_t align) {
+    count_allocation();
+    auto a = static_cast<size_t>(align);
+    if (void *p = std::aligned_alloc(a, (size + a - 1) / a * a))
+        return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    operator delete(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t align) noexcept {
+    operator delete(p, align);
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    players_thread = true;
+    bench_config config = get_bench_config(argc, argv);
+    bool generated = config.filename.empty();
+    if (generated)
+        config.filename = random_deals(config.deals, config.seed);
+    std::vector<Deal> deals;
+    try {
+        deals = load_deals(config.filename);
+    }
+    catch (const std::runtime_error &e) {
+        fatal("invalid description: %s", e.what());
+    }
+
+    server_config server;
+    server.filename = config.filename;
+    server.tables = config.tables;
+    server.loops = config.loops;
+    server.acceptors = config.acceptors;
+    server.half_open = 0; // the players all come from the loopback
+    server.max_connections = 0; // reconnecting players may briefly hold two
+    server.cork = config.cork;
+    server.log_file = config.log_file;
+    int socket_fd = socket_init(0, server.backlog, server.acceptors > 1);
+    int port = get_port(socket_fd);
+
+    double cpu_start = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID);
+    double players_cpu_start = cpu_seconds(CLOCK_THREAD_CPUTIME_ID);
+    auto start = Clock::now();
+    counting.store(true);
+    std::thread server_thread(run_server, std::cref(server), std::cref(deals), socket_fd);
+
+    std::vector<std::unique_ptr<Player>> players;
+    for (size_t table = 0; table < config.tables; table++) {
+        for (int pos = 0; pos < 4; pos++) {
+            players.push_back(join(port, table, get_seat_from_index(pos), config.resume));
+            if (players.back() == nullptr)
+                syserr("cannot connect to server");
+        }
+    }
+    Results results;
+    Game(players, port, config.reconnect, config.resume, config.seed).play(config.tables, results);
+    server_thread.join();
+    counting.store(false);
+    double wall = std::chrono::duration<double>(Clock::now() - start).count();
+    double players_cpu = cpu_seconds(CLOCK_THREAD_CPUTIME_ID) - players_cpu_start;
+    double server_cpu = cpu_seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu_start - players_cpu;
+    if (generated)
+        unlink(config.filename.c_str());
+
+    // the server finishes only once every table has played every deal
+    double played = static_cast<double>(config.tables * deals.size());
+    std::cout << "tables: " << config.tables << ", mode: "
+              << (config.loops > 0 ? std::to_string(config.loops) + " event loops" : "thread per player") << '\n'
+              << "deals: " << played << " in " << wall << " s (" << played / wall << " deals/s)\n"
+              << "moves: " << results.latencies.size() << ", latency p50 " << percentile(results.latencies, 0.5)
+              << " us, p99 " << percentile(results.latencies, 0.99) << " us\n"
+              << "server cpu: " << server_cpu * 1e6 / played << " us/deal (players: "
+              << players_cpu * 1e6 / played << " us/deal)\n"
+              << "server allocations: " << static_cast<double>(server_allocations.load()) /
+                 static_cast<double>(results.frames) << " per frame (" << server_allocations.load()
+              << " for " << results.frames << " frames)\n";
+    if (results.warm_moves > 0) {
+        uint64_t steady = server_allocations.load() - results.warm_allocations;
+        size_t moves = results.latencies.size() - results.warm_moves;
+        std::cout << "steady state (after the first deal): " << static_cast<double>(steady) /
+                     static_cast<double>(std::max<size_t>(moves, 1)) << " allocations per move ("
+                  << steady << " for " << moves << " moves)\n";
+    }
+    if (config.reconnect > 0)
+        std::cout << "reconnects: " << results.reconnects << " (after BUSY: " << results.busy << "), catch-up: "
+                  << static_cast<double>(results.catch_up_frames) / static_cast<double>(std::max<size_t>(results.reconnects, 1))
+                  << " frames per reconnect, WRONG during pauses: " << results.wrong << '\n';
+    return 0;
+}
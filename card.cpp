@@ -32,13 +32,6 @@ constexpr Value get_value (const std::string &s) {
     throw std::invalid_argument("Not a value");
 }
 
-constexpr std::string get_from_value (const Value &v) {
-    for (const auto &p : mapping_val)
-        if (p.second == v)
-            return p.first;
-    throw std::invalid_argument("Not a value");
-}
-
 constexpr Suit get_suit_from_char (const char &s) {
     for (const auto &p : mapping_suit)
         if (p.first == s)
@@ -46,30 +39,12 @@ constexpr Suit get_suit_from_char (const char &s) {
     throw std::invalid_argument("Not a value");
 }
 
-constexpr char get_from_suit (const Suit &v) {
-    for (const auto &p : mapping_suit)
-        if (p.second == v)
-            return p.first;
-    throw std::invalid_argument("Not a value");
-}
-
-Card::Card(const int &value, const int &suit) :
-    value(static_cast<Value>(value)), suit(static_cast<Suit>(suit)) {}
-
 Card::Card(std::string desc) {
-    suit = get_suit_from_char(desc[desc.size() - 1]);
+    Suit suit = get_suit_from_char(desc[desc.size() - 1]);
     desc.pop_back();
-    value = get_value(desc);
+    *this = Card(static_cast<int>(::get_value(desc)), static_cast<int>(suit));
 }
 
 std::string Card::to_string() const {
-    return get_from_value(value) + get_from_suit(suit);
-}
-
-bool Card::operator<(const Card &other) const {
-    return (suit == other.suit) && (value < other.value);
-}
-
-Suit Card::get_suit() const noexcept {
-    return suit;
+    return std::string(text());
 }
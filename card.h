@@ -1,9 +1,13 @@
 #ifndef GAME_H
 #define GAME_H
 
+#include <array>
+#include <bit>
 #include <compare>
 #include <cstdint>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
 enum class Value : uint8_t {
@@ -23,40 +27,190 @@ enum class Value : uint8_t {
 };
 enum class Suit : uint8_t {C, D, H, S};
 
+// Text of every card by its code (see Card), empty for codes that aren't cards.
+inline constexpr auto CARD_TEXT = [] {
+    constexpr std::string_view values[] = {"2", "3", "4", "5", "6", "7", "8", "9", "10", "J", "Q", "K", "A"};
+    constexpr char suits[] = {'C', 'D', 'H', 'S'};
+    struct Text {
+        char chars[3];
+        uint8_t len;
+    };
+    std::array<Text, 64> ans{};
+    for (int suit = 0; suit < 4; suit++) {
+        for (int value = 0; value < 13; value++) {
+            Text &t = ans[suit << 4 | value];
+            for (char c: values[value])
+                t.chars[t.len++] = c;
+            t.chars[t.len++] = suits[suit];
+        }
+    }
+    return ans;
+}();
+
+// A card packed into 6 bits: suit in bits 4-5, value in bits 0-3.
+// The code doubles as the card's bit in a Hand.
 class Card {
 private:
-    Value value;
-    Suit suit;
+    uint8_t code = 0;
 public:
-    Card(const int &value, const int &suit);
+    constexpr Card() = default;
+    constexpr Card(const int &value, const int &suit) :
+        code(static_cast<uint8_t>(suit << 4 | value)) {}
     explicit Card(std::string desc);
+    [[nodiscard]] static constexpr Card from_code(uint8_t code) noexcept {
+        Card c;
+        c.code = code;
+        return c;
+    }
     // card of different suit is always considered worse
-    bool operator<(const Card &other) const;
+    constexpr bool operator<(const Card &other) const noexcept {
+        return (code >> 4 == other.code >> 4) && code < other.code;
+    }
     bool operator==(const Card &other) const = default;
     [[nodiscard]] std::string to_string() const;
-    [[nodiscard]] Suit get_suit() const noexcept;
+    // same as to_string, without allocating
+    [[nodiscard]] constexpr std::string_view text() const noexcept {
+        return {CARD_TEXT[code].chars, CARD_TEXT[code].len};
+    }
+    [[nodiscard]] constexpr Suit get_suit() const noexcept {
+        return static_cast<Suit>(code >> 4);
+    }
+    [[nodiscard]] constexpr Value get_value() const noexcept {
+        return static_cast<Value>(code & 0xF);
+    }
+    [[nodiscard]] constexpr uint8_t get_code() const noexcept {
+        return code;
+    }
 };
 
-constexpr std::vector<Card> parse_cards(const std::string &input) {
-    size_t i = 0;
-    std::vector<Card> ans;
-    while (i < input.size()) {
-        if (input[i] == '1') { // must be 10
-            ans.emplace_back(input.substr(i, 3)); // 10 + suit
-            i += 3;
-        } else {
-            ans.emplace_back(input.substr(i, 2)); // (2-9/J/Q/K/A) + suit
-            i += 2;
+// A set of cards as a 64-bit mask (16 bits per suit, 13 of them used),
+// so lookups, removals and suit checks are single bit operations.
+class Hand {
+private:
+    uint64_t mask = 0;
+    static constexpr uint64_t bit(const Card &c) noexcept {
+        return uint64_t{1} << c.get_code();
+    }
+public:
+    static constexpr uint64_t suit_mask(Suit s) noexcept {
+        return uint64_t{0x1FFF} << (static_cast<int>(s) << 4);
+    }
+
+    // iterates over the cards by suit, then by value
+    class iterator {
+    private:
+        uint64_t rest;
+    public:
+        constexpr explicit iterator(uint64_t rest) noexcept : rest(rest) {}
+        constexpr Card operator*() const noexcept {
+            return Card::from_code(static_cast<uint8_t>(std::countr_zero(rest)));
+        }
+        constexpr iterator &operator++() noexcept {
+            rest &= rest - 1;
+            return *this;
         }
+        constexpr bool operator==(const iterator &other) const noexcept = default;
+    };
+
+    constexpr Hand() = default;
+    explicit Hand(const std::vector<Card> &cards) {
+        for (const Card &c: cards)
+            add(c);
     }
-    return ans;
-}
+    [[nodiscard]] constexpr bool contains(const Card &c) const noexcept {
+        return mask & bit(c);
+    }
+    constexpr void add(const Card &c) noexcept {
+        mask |= bit(c);
+    }
+    // returns whether the card was in the hand
+    constexpr bool remove(const Card &c) noexcept {
+        bool ans = contains(c);
+        mask &= ~bit(c);
+        return ans;
+    }
+    [[nodiscard]] constexpr bool has_suit(Suit s) const noexcept {
+        return mask & suit_mask(s);
+    }
+    [[nodiscard]] constexpr int count(Suit s) const noexcept {
+        return std::popcount(mask & suit_mask(s));
+    }
+    [[nodiscard]] constexpr int size() const noexcept {
+        return std::popcount(mask);
+    }
+    [[nodiscard]] constexpr bool empty() const noexcept {
+        return mask == 0;
+    }
+    // lowest card of the suit, the hand must have one
+    [[nodiscard]] constexpr Card lowest(Suit s) const noexcept {
+        return *iterator(mask & suit_mask(s));
+    }
+    [[nodiscard]] constexpr Card first() const noexcept {
+        return *begin();
+    }
+    [[nodiscard]] constexpr uint64_t get_mask() const noexcept {
+        return mask;
+    }
+    [[nodiscard]] constexpr iterator begin() const noexcept {
+        return iterator(mask);
+    }
+    [[nodiscard]] constexpr iterator end() const noexcept {
+        return iterator(0);
+    }
+    [[nodiscard]] std::vector<Card> to_vector() const {
+        std::vector<Card> ans;
+        ans.reserve(size());
+        for (Card c: *this)
+            ans.push_back(c);
+        return ans;
+    }
+    bool operator==(const Hand &other) const = default;
+};
 
 constexpr std::string cards_to_string(const std::vector<Card> &cards) {
     std::string ans;
     for (const Card &c : cards)
-        ans += c.to_string();
+        ans += c.text();
     return ans;
 }
 
+constexpr std::string cards_to_string(const Hand &hand) {
+    std::string ans;
+    for (Card c : hand)
+        ans += c.text();
+    return ans;
+}
+
+// SEAT-INDEX MAPPING
+
+constexpr int get_index_from_seat(char seat) {
+    switch (seat) {
+        case 'N':
+            return 0;
+        case 'E':
+            return 1;
+        case 'S':
+            return 2;
+        case 'W':
+            return 3;
+        default:
+            throw std::invalid_argument("not a valid seat");
+    }
+}
+
+constexpr char get_seat_from_index(int index) {
+    switch (index) {
+        case 0:
+            return 'N';
+        case 1:
+            return 'E';
+        case 2:
+            return 'S';
+        case 3:
+            return 'W';
+        default:
+            throw std::invalid_argument("not a valid index");
+    }
+}
+
 #endif
\ No newline at end of file
@@ -1,9 +1,9 @@
 #include <cstring>
 #include <iostream>
 #include <mutex>
+#include <sstream>
 #include <thread>
 #include <utility>
-#include <regex>
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -11,15 +11,17 @@
 #include "common.h"
 #include "err.h"
 #include "parser.h"
+#include "protocol.h"
+#include "strategy.h"
 
-class Message {
+class LastMessage {
 private:
     int type{};
     std::string value{};
     std::mutex mutex{};
     bool score_total = false; // were the last 2 messages score and total (in any order)
 public:
-    Message() = default;
+    LastMessage() = default;
     void update(const std::pair<int, std::string> &val) noexcept {
         std::unique_lock<std::mutex> lock(mutex);
         if ((type == SCORE && val.first == TOTAL) ||
@@ -41,17 +43,32 @@ public:
 };
 class DealState {
 private:
-    std::vector<Card> hand;
-    std::vector<std::vector<Card>> tricks;
+    Hand hand;
+    std::vector<std::vector<Card>> tricks; // the ones we took
     int trick_no = 1;
+    // what the automatic player knows about the others
+    int type = 1;
+    int seat = 0;
+    int leader = 0; // of the current trick
+    Hand played;
+    std::array<uint8_t, 4> voids{};
     std::mutex mutex{};
+
+    // notes the suits the players of trick (led by first) didn't follow
+    void note_voids(const std::vector<Card> &trick, int first) noexcept {
+        if (first < 0) // resumed, we don't know who led
+            return;
+        for (size_t i = 1; i < trick.size(); i++)
+            if (trick[i].get_suit() != trick[0].get_suit())
+                voids[(first + i) % 4] |= static_cast<uint8_t>(1 << static_cast<int>(trick[0].get_suit()));
+    }
 public:
     DealState() = default;
     const std::vector<std::vector<Card>> &get_tricks() noexcept {
         std::unique_lock<std::mutex> lock(mutex);
         return tricks;
     }
-    std::vector<Card> get_hand() noexcept {
+    Hand get_hand() noexcept {
         std::unique_lock<std::mutex> lock(mutex);
         return hand;
     }
@@ -59,39 +76,56 @@ public:
         std::unique_lock<std::mutex> lock(mutex);
         return trick_no;
     }
-    void put_trick(const std::vector<Card> &cards, bool add) noexcept {
+    void set_seat(char s) noexcept {
+        std::unique_lock<std::mutex> lock(mutex);
+        seat = get_index_from_seat(s);
+    }
+    void put_trick(const std::vector<Card> &cards, char taker, bool add) noexcept {
         std::unique_lock<std::mutex> lock(mutex);
         if (add)
             tricks.push_back(cards);
         trick_no++;
+        note_voids(cards, leader);
+        leader = get_index_from_seat(taker);
         for (const Card &c: cards) {
-            auto f = std::find(hand.begin(), hand.end(), c);
-            if (f != hand.end()) {
-                hand.erase(f);
-                return;
-            }
+            hand.remove(c);
+            played.add(c);
         }
     }
-    void set_hand(const std::vector<Card> &cards) noexcept {
+    void set_hand(const std::vector<Card> &cards, int deal_type, char first) noexcept {
         std::unique_lock<std::mutex> lock(mutex);
-        hand = cards;
+        hand = Hand(cards);
         trick_no = 1;
         tricks.clear();
+        type = deal_type >= 1 && deal_type <= 7 ? deal_type : 7;
+        leader = get_index_from_seat(first);
+        played = Hand();
+        voids = {};
     }
-    Card get_playable(const std::vector<Card> &cards) noexcept {
-        if (cards.empty())
-            return hand[0];
-        Suit s = cards[0].get_suit();
-        for (const Card &c: hand)
-            if (c.get_suit() == s)
-                return c;
-        return hand[0];
+    // cards left in a deal we resumed, the last trick taken comes next
+    void set_state(const std::vector<Card> &cards, int deal_type) noexcept {
+        std::unique_lock<std::mutex> lock(mutex);
+        hand = Hand(cards);
+        trick_no = 13 - static_cast<int>(cards.size());
+        tricks.clear();
+        type = deal_type >= 1 && deal_type <= 7 ? deal_type : 7;
+        leader = -1;
+        played = Hand();
+        voids = {};
+    }
+    Situation get_situation(const std::vector<Card> &trick) noexcept {
+        std::unique_lock<std::mutex> lock(mutex);
+        // whoever led, we come right after the cards on the table
+        int first = (seat + 4 - static_cast<int>(trick.size() % 4)) % 4;
+        note_voids(trick, first);
+        return {.type = type, .seat = seat, .tricks_done = trick_no - 1, .leader = first,
+                .hand = hand, .played = played, .trick = trick, .voids = voids};
     }
 };
 
 // GLOBAL VARIABLES (+INTERTHREAD COMMUNICATION)
 
-static Message last_msg;
+static LastMessage last_msg;
 static DealState game;
 static int game_over = eventfd(0, 0);
 
@@ -138,46 +172,42 @@ void send_IAM(SendData &send_data, const char &seat) {
         throw std::runtime_error("sending IAM");
 }
 
-// returns pair (type of message, message content)
-std::pair<int, std::string> get_message(SendData &send_data) {
-    std::pair<int, std::string> ans{INCORRECT, ""};
-    auto tmp = get_line(send_data, ans.second);
+void send_RESUME(SendData &send_data, const char &seat, const std::string &token) {
+    std::string msg = "RESUME" + std::string(1, seat) + token + "\r\n";
+    if (writen(send_data, msg.data(), msg.size()) != static_cast<ssize_t>(msg.size()))
+        throw std::runtime_error("sending RESUME");
+}
+
+// fills msg with pair (type of message, message content) and parses the content
+// into parsed, which points into msg.second
+void get_message(SendData &send_data, std::pair<int, std::string> &msg, Message &parsed) {
+    auto tmp = get_line(send_data, msg.second);
     if (tmp <= 0)
         throw std::runtime_error("couldn't receive message");
-    for (int i = 0; i < REGEXES_NO; i++) {
-        if (std::regex_match(ans.second, regexes[i])) {
-            ans.first = i;
-            return ans;
-        }
-    }
-    return ans;
+    parse_message(msg.second, parsed);
+    msg.first = parsed.type;
 }
 
-std::vector<Card> process_card_message(std::stringstream &output,
-                                       const std::smatch &matches,
-                                       size_t first_card,
-                                       size_t last_card) {
-    std::vector<Card> cards;
-    for (size_t i = first_card; i < last_card && !matches[i].str().empty(); i++)
-        cards.emplace_back(matches[i]);
+std::vector<Card> process_card_message(std::stringstream &output, const Message &parsed) {
+    std::vector<Card> cards(parsed.cards.begin(), parsed.cards.begin() + parsed.cards_no);
     output << print_list(cards);
     return cards;
 }
 
-void process_BUSY(std::stringstream &output, const std::smatch &matches) {
+void process_BUSY(std::stringstream &output, const Message &parsed) {
     increment_event_fd(game_over);
     output << "Place busy, list of busy places received: ";
-    for (size_t i = 1; i < matches.size() && !matches[i].str().empty(); i++) {
-        output << matches[i];
-        if (i < matches.size() - 1 && !matches[i + 1].str().empty())
+    for (size_t i = 0; i < parsed.seats_no; i++) {
+        output << parsed.seats[i];
+        if (i + 1 < parsed.seats_no)
             output << ", ";
     }
     output << '.';
 }
 
-void process_score_message(std::stringstream &output, const std::smatch &matches) {
+void process_score_message(std::stringstream &output, const Message &parsed) {
     for (int i = 0; i < 4; i++) {
-        output << matches[1 + 2 * i] << " | " << matches[2 + 2 * i];
+        output << parsed.seats[i] << " | " << parsed.points[i];
         if (i < 3)
             output << '\n';
     }
@@ -197,7 +227,7 @@ void cin_worker(SendData &send_data) {
         // else we have something on stdin
         std::getline(std::cin, request);
         if (request == "cards") {
-            std::cout << print_list(game.get_hand()) << std::endl;
+            std::cout << print_list(game.get_hand().to_vector()) << std::endl;
         }
         else if (request == "tricks") {
             const auto &t = game.get_tricks();
@@ -223,6 +253,11 @@ void cin_worker(SendData &send_data) {
 
 int main(int argc, char *argv[]) {
     client_config config = get_client_config(argc, argv);
+    std::unique_ptr<Strategy> strategy =
+        make_strategy(config.strategy, std::chrono::milliseconds(config.budget), config.threads);
+    if (strategy == nullptr)
+        details::usage_client();
+    game.set_seat(config.seat);
     sockaddr_storage server_address{}, client_address{};
     int socket_fd = socket_init(config.host, config.port, config.ipv, &server_address);
     auto addr_size = static_cast<socklen_t>(sizeof client_address);
@@ -230,60 +265,77 @@ int main(int argc, char *argv[]) {
         close(socket_fd);
         syserr("getsockname");
     }
-    SendData send_data(socket_fd, client_address, server_address);
+    // only the automatic player reports messages (on stdout)
+    std::unique_ptr<Logger> logger;
+    if (config.auto_player)
+        logger = std::make_unique<Logger>();
+    SendData send_data(socket_fd, client_address, server_address, logger.get());
     std::thread cinner;
     if (!config.auto_player)
         cinner = std::thread(cin_worker, std::ref(send_data));
     try {
-        send_IAM(send_data, config.seat);
+        if (config.token.empty())
+            send_IAM(send_data, config.seat);
+        else
+            send_RESUME(send_data, config.seat, config.token);
         while (true) {
-            auto msg = get_message(send_data);
+            std::pair<int, std::string> msg;
+            Message parsed;
+            get_message(send_data, msg, parsed);
             if (msg.first == INCORRECT)
                 continue;
             last_msg.update(msg);
-            std::smatch matches;
-            std::regex_match(msg.second, matches, regexes[msg.first]);
             std::stringstream ss;
             std::vector<Card> cards;
             switch (msg.first) {
                 case BUSY:
-                    process_BUSY(ss, matches);
+                    process_BUSY(ss, parsed);
                     if (!config.auto_player)
                         std::cout << ss.str() << std::endl;
                     throw std::runtime_error("");
                 case DEAL:
-                    ss << "New deal: " << matches[1] << ": staring place "
-                       << matches[2] << ", your cards: ";
-                    cards = process_card_message(ss, matches, 3, matches.size());
+                    ss << "New deal: " << parsed.number_text << ": staring place "
+                       << parsed.seat << ", your cards: ";
+                    cards = process_card_message(ss, parsed);
                     ss << '.';
-                    game.set_hand(cards);
+                    game.set_hand(cards, parsed.number, parsed.seat);
                     break;
                 case TRICK:
-                    ss << "Trick: (" << matches[1] << ") ";
-                    cards = process_card_message(ss, matches, 2, matches.size());
-                    ss << "\nAvailable: " << print_list(game.get_hand());
+                    ss << "Trick: (" << parsed.number_text << ") ";
+                    cards = process_card_message(ss, parsed);
+                    ss << "\nAvailable: " << print_list(game.get_hand().to_vector());
                     if (config.auto_player) {
-                        Card c = game.get_playable(cards);
+                        Card c = strategy->choose(game.get_situation(cards));
                         send_TRICK(send_data, game.get_trick(), std::vector<Card>{c});
                     }
                     break;
                 case WRONG:
-                    ss << "Wrong message received in trick " << matches[1] << '.';
+                    ss << "Wrong message received in trick " << parsed.number_text << '.';
                     break;
                 case TAKEN:
-                    ss << "A trick " << matches[1] << " is taken by "
-                       << matches[matches.size() - 1] << ", cards ";
-                    cards = process_card_message(ss, matches, 2, matches.size() - 1);
-                    game.put_trick(cards, (matches[matches.size() - 1] == config.seat));
+                    ss << "A trick " << parsed.number_text << " is taken by "
+                       << parsed.seat << ", cards ";
+                    cards = process_card_message(ss, parsed);
+                    game.put_trick(cards, parsed.seat, parsed.seat == config.seat);
                     ss << '.';
                     break;
                 case SCORE:
                     ss << "The scores are:\n";
-                    process_score_message(ss, matches);
+                    process_score_message(ss, parsed);
                     break;
                 case TOTAL:
                     ss << "The total scores are:\n";
-                    process_score_message(ss, matches);
+                    process_score_message(ss, parsed);
+                    break;
+                case TOKEN:
+                    ss << "To come back to this seat: -r " << msg.second.substr(6, TOKEN_DIGITS);
+                    break;
+                case STATE:
+                    ss << "Resumed deal: " << parsed.number_text << ": starting place "
+                       << parsed.seat << ", your cards: ";
+                    cards = process_card_message(ss, parsed);
+                    ss << '.';
+                    game.set_state(cards, parsed.number);
                     break;
             }
             if (!config.auto_player)
@@ -293,12 +345,8 @@ int main(int argc, char *argv[]) {
     catch (const std::runtime_error &e) {
         // server disconnected or other error occured
         increment_event_fd(game_over);
-        if (config.auto_player) {
-            Log log;
-            send_data.append_to_log(log);
-            for (const Log_message &msg: log)
-                std::cout << msg.second;
-        }
+        if (config.auto_player)
+            logger->stop();
         else
             cinner.join();
         close(socket_fd);
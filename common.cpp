@@ -1,88 +1,194 @@
+#include <algorithm>
 #include <cmath>
+#include <sstream>
 #include <unistd.h>
-#include <iomanip>
-#include <mutex>
 #include <poll.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 
 #include "common.h"
+#include "frame.h"
+#include "protocol.h"
+#include "trace.h"
 
 ssize_t get_line (SendData &send_data, std::string &ans, size_t max_length) {
-    char c;
-    ssize_t nread;
-    auto now = std::chrono::system_clock::now();
-    do {
-        now = std::chrono::system_clock::now();
-        if ((nread = read(send_data.get_fd(), &c, 1)) <= 0)
+    TRACE_SPAN("get_line");
+    int status;
+    while ((status = send_data.take_line(ans, max_length)) == 0) {
+        ssize_t nread = send_data.receive();
+        if (nread <= 0)
             return nread; // error
-        if (c != 0)
-            ans += c;
+    }
+    send_data.log_message(ans, get_timestamp(), false);
+    return status;
+}
+
+int take_line(std::string_view data, std::string &ans, size_t &consumed, size_t max_length) {
+    size_t i = 0;
+    while (i < data.size()) {
+        char c = data[i++];
         if (max_length-- == 0 || c == 0) {
-            auto sec_point = std::chrono::time_point_cast<std::chrono::seconds>(now);
-            auto sec = sec_point.time_since_epoch().count();
-            auto nsec_point = std::chrono::time_point_cast<std::chrono::nanoseconds>(now)
-                              - std::chrono::time_point_cast<std::chrono::nanoseconds>(sec_point);
-            auto nsec = nsec_point.count();
-            timespec t = {.tv_sec = sec, .tv_nsec = nsec};
+            ans.assign(data.substr(0, c == 0 ? i - 1 : i));
+            ans += "\r\n";
+            consumed = i;
+            return -1;
+        }
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            if (c == '\r') {
+                if (i == data.size())
+                    return 0;
+                c = data[i++];
+            }
+            ans.assign(data.substr(0, c == 0 ? i - 1 : i));
+            consumed = i;
+            if (ans.ends_with("\r\n"))
+                return 1;
             ans += "\r\n";
-            send_data.log_message(ans.c_str(), t, false);
             return -1;
         }
-    } while (c != 0 && !std::isspace(c));
-    if (c == '\r') {
-        now = std::chrono::system_clock::now();
-        if ((nread = read(send_data.get_fd(), &c, 1)) <= 0)
-            return nread; // error
-        if (c != 0)
-            ans += c;
-    }
-    auto sec_point = std::chrono::time_point_cast<std::chrono::seconds>(now);
-    auto sec = sec_point.time_since_epoch().count();
-    auto nsec_point = std::chrono::time_point_cast<std::chrono::nanoseconds>(now)
-                      - std::chrono::time_point_cast<std::chrono::nanoseconds>(sec_point);
-    auto nsec = nsec_point.count();
-    timespec t = {.tv_sec = sec, .tv_nsec = nsec};
-    if (ans.ends_with("\r\n")) {
-        send_data.log_message(ans.c_str(), t, false);
-        return 1;
-    }
-    else {
-        ans += "\r\n";
-        send_data.log_message(ans.c_str(), t, false);
-        return -1;
     }
+    return 0;
+}
+
+timespec get_timestamp() noexcept {
+    timespec t{};
+    clock_gettime(CLOCK_REALTIME, &t);
+    return t;
 }
 
 // Following function comes from Stevens' "UNIX Network Programming" book...
 // ...but has been adapted to this task by myself (JO)
 // Write n bytes to a descriptor.
 ssize_t writen(SendData &send_data, const void *vptr, size_t n) {
-    ssize_t nleft, nwritten;
-    const char *ptr;
-
-    ptr = (const char*) vptr;  // Can't do pointer arithmetic on void*.
-    nleft = n;
-    auto now = std::chrono::system_clock::now();
-    while (nleft > 0) {
-        now = std::chrono::system_clock::now();
-        if ((nwritten = write(send_data.get_fd(), ptr, nleft)) <= 0)
-            return nwritten;  // error
-
-        nleft -= nwritten;
-        ptr += nwritten;
+    TRACE_SPAN("writen");
+    OutQueue &out = send_data.out;
+    const int fd = send_data.get_fd();
+    const char *ptr = static_cast<const char *>(vptr);
+    size_t nleft = n;
+    ssize_t nwritten = 0;
+    iovec iov[OutQueue::MAX_IOV + 1];
+    Cork cork(send_data);
+    timespec t{};
+    while (!out.empty() || nleft > 0) {
+        bool all = true;
+        int count = out.fill(iov, OutQueue::MAX_IOV, all);
+        if (all && nleft > 0) // the frame goes right after the queue
+            iov[count++] = {.iov_base = const_cast<char *>(ptr), .iov_len = nleft};
+        t = get_timestamp();
+        if ((nwritten = writev(fd, iov, count)) <= 0)
+            break;  // error
+        send_data.count_sent(nwritten);
+        // skip what has been written
+        auto done = std::min(static_cast<size_t>(nwritten), out.size());
+        out.consume(done);
+        ptr += static_cast<size_t>(nwritten) - done;
+        nleft -= static_cast<size_t>(nwritten) - done;
     }
-    auto sec_point = std::chrono::time_point_cast<std::chrono::seconds>(now);
-    auto sec = sec_point.time_since_epoch().count();
-    auto nsec_point = std::chrono::time_point_cast<std::chrono::nanoseconds>(now)
-                      - std::chrono::time_point_cast<std::chrono::nanoseconds>(sec_point);
-    auto nsec = nsec_point.count();
-    timespec t = {.tv_sec = sec, .tv_nsec = nsec};
-    std::string msg(static_cast<const char *>(vptr), n);
-    send_data.log_message(msg.c_str(), t, true);
+    if (!out.empty() || nleft > 0)
+        return nwritten;
+    if (n > 0)
+        send_data.log_message(std::string_view(static_cast<const char *>(vptr), n), t, true);
+    return static_cast<ssize_t>(n);
+}
+
+bool flush(SendData &send_data) {
+    if (send_data.has_pending())
+        writen(send_data, nullptr, 0);
+    return !send_data.has_pending();
+}
+
+ssize_t write_some(SendData &send_data) {
+    TRACE_SPAN("write_some");
+    iovec iov[OutQueue::MAX_IOV];
+    bool all;
+    int count = send_data.out.fill(iov, OutQueue::MAX_IOV, all);
+    ssize_t n = writev(send_data.get_fd(), iov, count);
+    send_data.count_sent(n);
+    if (n > 0)
+        send_data.out.consume(static_cast<size_t>(n));
     return n;
 }
 
+// OUT QUEUE
+
+void OutQueue::push(std::string_view msg) {
+    if (msg.empty())
+        return;
+    // glued to the last segment if that one is owned too
+    if (segments.size() > first && !segments.back().shared.get() &&
+        segments.back().begin + segments.back().len == owned.size())
+        segments.back().len += msg.size();
+    else
+        segments.push_back({.shared = {}, .begin = owned.size(), .len = msg.size()});
+    owned += msg;
+    bytes += msg.size();
+}
+
+void OutQueue::push(const FrameRef &frame) {
+    segments.push_back({.shared = frame, .begin = 0, .len = frame.view().size()});
+    bytes += frame.view().size();
+}
+
+bool OutQueue::empty() const noexcept {
+    return bytes == 0;
+}
+
+size_t OutQueue::size() const noexcept {
+    return bytes;
+}
+
+int OutQueue::fill(iovec *iov, int max, bool &all) const noexcept {
+    int count = 0;
+    size_t skip = written;
+    for (size_t i = first; i < segments.size(); i++) {
+        if (count == max) {
+            all = false;
+            return count;
+        }
+        const Segment &s = segments[i];
+        const char *data = s.shared.get() ? s.shared.view().data() : owned.data() + s.begin;
+        iov[count++] = {.iov_base = const_cast<char *>(data + skip), .iov_len = s.len - skip};
+        skip = 0;
+    }
+    all = true;
+    return count;
+}
+
+void OutQueue::consume(size_t n) noexcept {
+    bytes -= n;
+    while (n > 0) {
+        Segment &s = segments[first];
+        size_t k = std::min(n, s.len - written);
+        written += k;
+        n -= k;
+        if (written == s.len) {
+            s.shared = FrameRef();
+            first++;
+            written = 0;
+        }
+    }
+    if (bytes == 0) {
+        segments.clear();
+        owned.clear();
+        first = 0;
+    }
+}
+
+bool OutQueue::reset() noexcept {
+    if (bytes != 0)
+        return false;
+    // the containers let go of the arena's memory before it's rewound (a
+    // string moved into would keep its capacity, swapping doesn't)
+    std::pmr::vector<Segment>(&arena).swap(segments);
+    std::pmr::string(&arena).swap(owned);
+    first = 0;
+    arena.release();
+    return true;
+}
+
 // returns <ip>:<port>, (ENDING WITH A COMMA)
 std::string get_ip(const sockaddr_storage &address) {
     std::stringstream ss;
@@ -107,44 +213,148 @@ std::string get_ip(const sockaddr_storage &address) {
 SendData::SendData(
         int fd,
         const sockaddr_storage &sender,
-        const sockaddr_storage &receiver
-) : fd(fd),
-    sender_receiver(get_ip(sender) + get_ip(receiver)),
-    receiver_sender(get_ip(receiver) + get_ip(sender)) {
+        const sockaddr_storage &receiver,
+        Logger *logger,
+        Metrics *metrics
+) : fd(fd), metrics(metrics) {
+    if (logger != nullptr)
+        log = logger->open(get_ip(sender) + get_ip(receiver), get_ip(receiver) + get_ip(sender));
+    if (metrics != nullptr) {
+        metrics->connections.fetch_add(1, std::memory_order_relaxed);
+        count(metrics->connections_total);
+    }
+}
+
+SendData::~SendData() {
+    if (log)
+        log->close();
+    if (metrics != nullptr)
+        metrics->connections.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void SendData::count_sent(ssize_t n) noexcept {
+    if (metrics != nullptr && n > 0)
+        count(metrics->bytes_sent, static_cast<uint64_t>(n));
 }
 
 int SendData::get_fd() const noexcept {
     return fd;
 }
 
-void SendData::log_message(const char *msg, const timespec &t, bool send) {
-    std::stringstream ss;
-    ss << '[' << (send ? sender_receiver : receiver_sender) <<
-        std::put_time(std::localtime(&t.tv_sec), "%Y-%m-%dT%H:%M:%S") << '.' <<
-        std::setw(3) << std::setfill('0') << t.tv_nsec / 1'000'000 << "] " << msg;
-    log.emplace_back(t, ss.str());
+void SendData::log_message(std::string_view msg, const timespec &t, bool send) {
+    if (log)
+        log->push(t, send, msg);
+}
+
+void SendData::queue(std::string_view frame) {
+    log_message(frame, get_timestamp(), true);
+    out.push(frame);
+}
+
+void SendData::queue(const FrameRef &frame) {
+    if (log)
+        log->push(get_timestamp(), true, *frame.get());
+    out.push(frame);
+}
+
+bool SendData::has_pending() const noexcept {
+    return !out.empty();
+}
+
+size_t SendData::pending_bytes() const noexcept {
+    return out.size();
+}
+
+void SendData::set_cork(bool on) noexcept {
+    cork = on;
+}
+
+bool SendData::get_cork() const noexcept {
+    return cork;
+}
+
+void SendData::new_deal() noexcept {
+    out.reset();
+}
+
+Cork::Cork(const SendData &send_data) : fd(send_data.get_cork() ? send_data.get_fd() : -1) {
+    int on = 1;
+    if (fd != -1)
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof on);
+}
+
+Cork::~Cork() {
+    int off = 0;
+    if (fd != -1)
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof off);
+}
+
+ssize_t SendData::receive() {
+    if (in_begin == in_end)
+        in_begin = in_end = 0;
+    else if (in_end == in.size()) {
+        std::copy(in.begin() + in_begin, in.begin() + in_end, in.begin());
+        in_end -= in_begin;
+        in_begin = 0;
+    }
+    read_calls++;
+    ssize_t nread = read(fd, in.data() + in_end, in.size() - in_end);
+    if (nread > 0) {
+        in_end += nread;
+        if (metrics != nullptr)
+            count(metrics->bytes_received, static_cast<uint64_t>(nread));
+    }
+    return nread;
+}
+
+int SendData::take_line(std::string &ans, size_t max_length) {
+    size_t consumed = 0;
+    int status = ::take_line(std::string_view(in.data() + in_begin, in_end - in_begin),
+                             ans, consumed, max_length);
+    if (status != 0) {
+        in_begin += consumed;
+        messages_received++;
+    }
+    return status;
+}
+
+void SendData::discard() noexcept {
+    in_begin = in_end = 0;
+}
+
+bool SendData::has_buffered() const noexcept {
+    return in_begin != in_end;
+}
+
+bool SendData::has_line(size_t max_length) const {
+    std::string ans;
+    size_t consumed = 0;
+    return ::take_line(std::string_view(in.data() + in_begin, in_end - in_begin), ans, consumed, max_length) != 0;
+}
+
+uint64_t SendData::get_read_calls() const noexcept {
+    return read_calls;
 }
 
-static std::mutex mutex;
-void SendData::append_to_log(Log &general_log) {
-    std::unique_lock<std::mutex> lock(mutex);
-    general_log.insert(general_log.end(), log.begin(), log.end());
+uint64_t SendData::get_messages_received() const noexcept {
+    return messages_received;
 }
 
-char get_IAM(SendData &send_data) {
-    static constexpr ssize_t IAM_SIZE = 6;
-    static const std::regex IAM_REGEX("IAM[NESW]\r\n");
+char get_IAM(SendData &send_data, uint64_t &token, bool &tokens) {
     std::string msg;
-    if (get_line(send_data, msg, IAM_SIZE) < 0)
+    char seat;
+    token = 0;
+    if (get_line(send_data, msg, HELLO_SIZE) < 0)
         throw std::runtime_error("receiving IAM");
-    if (!std::regex_match(msg, IAM_REGEX))
+    tokens = !parse_IAM(msg, seat);
+    if (tokens && !parse_RESUME(msg, seat, token))
         throw std::runtime_error("Invalid IAM message");
-    return msg[3];
+    return seat;
 }
 
-void send_TRICK(SendData &send_data, int no, const std::vector<Card> &trick) {
-    std::string s = "TRICK" + std::to_string(no) + cards_to_string(trick) + "\r\n";
-    if (writen(send_data, s.c_str(), s.size()) < static_cast<ssize_t>(s.size()))
+void send_TRICK(SendData &send_data, int no, std::span<const Card> trick) {
+    Frame f = frame_TRICK(no, trick);
+    if (writen(send_data, f.data(), f.size()) < static_cast<ssize_t>(f.size()))
         throw std::runtime_error("sending TRICK");
 }
 
@@ -1,116 +1,150 @@
 #ifndef MIM_COMMON_H
 #define MIM_COMMON_H
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
-#include <regex>
+#include <memory>
+#include <memory_resource>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include <vector>
 #include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include "card.h"
 #include "err.h"
+#include "frame.h"
+#include "logger.h"
+#include "metrics.h"
 
 // CLASSES
 
-typedef std::pair<timespec, std::string> Log_message;
-typedef std::vector<Log_message> Log;
+constexpr size_t RECEIVE_BUFFER = 4096;
+
+// Messages waiting to be written, in order. Shared frames are referenced,
+// the rest is copied; the memory is kept for the next messages. It comes
+// from the queue's own arena, which starts in the queue and only asks the
+// heap for more after a backlog; reset gives it all back.
+class OutQueue {
+public:
+    static constexpr int MAX_IOV = 64;   // iovecs given to a single writev
+    static constexpr size_t ARENA = 2048; // bytes of the arena kept in the queue
+private:
+    struct Segment {
+        FrameRef shared; // if empty, the bytes are owned[begin, begin + len)
+        size_t begin;
+        size_t len;
+    };
+    alignas(std::max_align_t) std::array<std::byte, ARENA> initial;
+    std::pmr::monotonic_buffer_resource arena{initial.data(), initial.size()};
+    std::pmr::string owned{&arena};
+    std::pmr::vector<Segment> segments{&arena};
+    size_t first = 0;   // segments before it are written
+    size_t written = 0; // bytes of the first segment already written
+    size_t bytes = 0;   // not written yet
+public:
+    void push(std::string_view msg);
+    void push(const FrameRef &frame);
+    [[nodiscard]] bool empty() const noexcept;
+    [[nodiscard]] size_t size() const noexcept;
+    // points iov at up to max segments from the start, returns their number;
+    // all tells whether that's the whole queue
+    int fill(iovec *iov, int max, bool &all) const noexcept;
+    // drops n written bytes from the start
+    void consume(size_t n) noexcept;
+    // if nothing is queued, frees the memory and rewinds the arena
+    bool reset() noexcept;
+};
 
 class SendData {
 private:
     const int fd;
-    Log log;
-    const std::string sender_receiver;
-    const std::string receiver_sender;
+    std::shared_ptr<LogRing> log; // nullptr if messages aren't logged
+    Metrics *metrics;             // nullptr if not counted
+    // received bytes not split into messages yet are in[in_begin, in_end)
+    std::array<char, RECEIVE_BUFFER> in;
+    size_t in_begin = 0;
+    size_t in_end = 0;
+    uint64_t read_calls = 0;
+    uint64_t messages_received = 0;
+    OutQueue out; // queued frames, not sent yet
+    bool cork = false; // TCP_CORK around every flush
+    friend ssize_t writen(SendData &send_data, const void *vptr, size_t n);
+    friend ssize_t write_some(SendData &send_data);
+    void count_sent(ssize_t n) noexcept;
 public:
     SendData(
             int fd,
             const sockaddr_storage &sender,
-            const sockaddr_storage &receiver
+            const sockaddr_storage &receiver,
+            Logger *logger = nullptr,
+            Metrics *metrics = nullptr
     );
+    ~SendData();
+    SendData(const SendData &) = delete;
+    SendData &operator=(const SendData &) = delete;
     [[nodiscard]] int get_fd() const noexcept;
-    void log_message(const char *msg, const timespec &t, bool send);
-    void append_to_log(Log &general_log);
+    void log_message(std::string_view msg, const timespec &t, bool send);
+    // logs the frame now, it goes out with the next writen, flush or write_some
+    void queue(std::string_view frame);
+    void queue(const FrameRef &frame);
+    [[nodiscard]] bool has_pending() const noexcept;
+    [[nodiscard]] size_t pending_bytes() const noexcept;
+    void set_cork(bool on) noexcept;
+    [[nodiscard]] bool get_cork() const noexcept;
+    // called at deal boundaries, see OutQueue::reset
+    void new_deal() noexcept;
+    // a single read(2) into the receive buffer, returns what read returned
+    ssize_t receive();
+    // cuts the first message off the receive buffer, see take_line
+    int take_line(std::string &ans, size_t max_length = 100);
+    void discard() noexcept;
+    [[nodiscard]] bool has_buffered() const noexcept;
+    // whether take_line would return a message (correct or not)
+    [[nodiscard]] bool has_line(size_t max_length = 100) const;
+    [[nodiscard]] uint64_t get_read_calls() const noexcept;
+    [[nodiscard]] uint64_t get_messages_received() const noexcept;
 };
 
-// SEAT-INDEX MAPPING
-
-constexpr int get_index_from_seat(char seat) {
-    switch (seat) {
-        case 'N':
-            return 0;
-        case 'E':
-            return 1;
-        case 'S':
-            return 2;
-        case 'W':
-            return 3;
-        default:
-            throw std::invalid_argument("not a valid seat");
-    }
-}
-
-constexpr char get_seat_from_index(int index) {
-    switch (index) {
-        case 0:
-            return 'N';
-        case 1:
-            return 'E';
-        case 2:
-            return 'S';
-        case 3:
-            return 'W';
-        default:
-            throw std::invalid_argument("not a valid index");
-    }
-}
+// Holds TCP_CORK on the connection while alive, if its SendData asks for it.
+class Cork {
+private:
+    const int fd; // -1 if not corking
+public:
+    explicit Cork(const SendData &send_data);
+    ~Cork();
+    Cork(const Cork &) = delete;
+    Cork &operator=(const Cork &) = delete;
+};
 
 // COMMUNICATION
 
+// writes the queued frames followed by n bytes at vptr (in a single writev if possible)
 ssize_t writen(SendData &send_data, const void *vptr, size_t n);
+// writes the queued frames, false on error
+bool flush(SendData &send_data);
+// a single writev of the queued frames (for non-blocking sockets), returns what writev returned
+ssize_t write_some(SendData &send_data);
 ssize_t get_line(SendData &send_data, std::string &ans, size_t max_length = 100);
+// Finds the first message in data: it ends with the first whitespace (a '\r'
+// takes one more byte) or NUL, or after max_length + 1 bytes. Returns 1
+// (correct message), -1 (incorrect message, "\r\n" appended to ans) or 0 if
+// the message is not complete yet; consumed is set to the message's length.
+int take_line(std::string_view data, std::string &ans, size_t &consumed, size_t max_length = 100);
+timespec get_timestamp() noexcept;
 void increment_event_fd(int event_fd, uint64_t val = 1);
 void decrement_event_fd(int event_fd, uint64_t times = 1);
 void clear_event_fd(int event_fd);
-const std::string CARD_REGEX("((?:[1-9]|10|Q|J|K|A)(?:[CDHS]))");
-constexpr std::string multiply_string(const std::string &input, int times) {
-    std::string ans;
-    while (times--)
-        ans += input;
-    return ans;
-}
 
 // COMMUNICATION
 
-void send_TRICK(SendData &send_data, int no, const std::vector<Card> &trick);
-char get_IAM(SendData &send_data);
+void send_TRICK(SendData &send_data, int no, std::span<const Card> trick);
+// IAM or RESUME (with tokens set), token is 0 for IAM and for a RESUME
+// asking for a new seat
+char get_IAM(SendData &send_data, uint64_t &token, bool &tokens);
 const std::string timeout_trick_msg = "timeout on receiving TRICK";
 
-// REGEXES
-
-const std::regex BUSY_REGEX("BUSY" + multiply_string("([NESW])?", 4) + "\r\n");
-const std::regex DEAL_REGEX ("DEAL([1-7])([NESW])" + multiply_string(CARD_REGEX, 13) + "\r\n");
-const std::regex TRICK_REGEX ("TRICK([1-9]|1[0-3])" +
-                              multiply_string(CARD_REGEX + '?', 4) + "\r\n");
-const std::regex WRONG_REGEX ("WRONG([1-9|1[0-3])\r\n");
-const std::regex TAKEN_REGEX ("TAKEN([1-9]|1[0-3])" +
-                              multiply_string(CARD_REGEX, 4) + "([NESW])\r\n");
-const std::regex SCORE_REGEX("SCORE" + multiply_string("([NESW])(\\d+)", 4) + "\r\n");
-const std::regex TOTAL_REGEX("TOTAL" + multiply_string("([NESW])(\\d+)", 4) + "\r\n");
-
-// MESSAGE IDS
-
-constexpr int BUSY = 0;
-constexpr int DEAL = BUSY + 1; // 1
-constexpr int TRICK = DEAL + 1; // 2
-constexpr int WRONG = TRICK + 1; // 3
-constexpr int TAKEN = WRONG + 1; // 4
-constexpr int SCORE = TAKEN + 1; // 5
-constexpr int TOTAL = SCORE + 1; // 6
-constexpr int INCORRECT = TOTAL + 1; // 7
-constexpr int REGEXES_NO = 7;
-const std::regex regexes[REGEXES_NO] = {BUSY_REGEX, DEAL_REGEX,
-                                        TRICK_REGEX, WRONG_REGEX,
-                                        TAKEN_REGEX, SCORE_REGEX,
-                                        TOTAL_REGEX};
-
 #endif
@@ -0,0 +1,128 @@
+#include "deals.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string_view>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+
+namespace {
+    class Mapping {
+    private:
+        void *data = MAP_FAILED;
+        size_t size = 0;
+    public:
+        explicit Mapping(const std::string &filename) {
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd == -1)
+                throw std::runtime_error(filename + ": " + strerror(errno));
+            struct stat st{};
+            if (fstat(fd, &st) == -1) {
+                close(fd);
+                throw std::runtime_error(filename + ": " + strerror(errno));
+            }
+            size = static_cast<size_t>(st.st_size);
+            if (size > 0) {
+                data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED) {
+                    close(fd);
+                    throw std::runtime_error(filename + ": " + strerror(errno));
+                }
+                madvise(data, size, MADV_SEQUENTIAL);
+            }
+            close(fd);
+        }
+        ~Mapping() {
+            if (data != MAP_FAILED)
+                munmap(data, size);
+        }
+        Mapping(const Mapping &) = delete;
+        Mapping &operator=(const Mapping &) = delete;
+        [[nodiscard]] std::string_view view() const noexcept {
+            return size > 0 ? std::string_view(static_cast<const char *>(data), size) : std::string_view();
+        }
+    };
+
+    // Splits the file into lines ("\n" or "\r\n" terminated), counting them.
+    class Lines {
+    private:
+        std::string_view rest;
+        size_t number = 0;
+    public:
+        explicit Lines(std::string_view s) noexcept : rest(s) {}
+        bool next(std::string_view &line) noexcept {
+            if (rest.empty())
+                return false;
+            size_t end = rest.find('\n');
+            line = rest.substr(0, end);
+            rest.remove_prefix(end == std::string_view::npos ? rest.size() : end + 1);
+            if (line.ends_with('\r'))
+                line.remove_suffix(1);
+            number++;
+            return true;
+        }
+        [[nodiscard]] bool only_blank_left() const noexcept {
+            return rest.find_first_not_of("\r\n") == std::string_view::npos;
+        }
+        [[nodiscard]] size_t get_number() const noexcept {
+            return number;
+        }
+    };
+
+    [[noreturn]] void reject(const std::string &filename, size_t line, const std::string &what) {
+        throw std::runtime_error(filename + ":" + std::to_string(line) + ": " + what);
+    }
+
+    Hand parse_hand(std::string_view line, const std::string &filename, size_t number) {
+        Hand hand;
+        size_t i = 0;
+        while (i < line.size()) {
+            Card c;
+            size_t len = parse_card(line, i, c);
+            if (len == 0)
+                reject(filename, number, "not a card at column " + std::to_string(i + 1));
+            if (hand.contains(c))
+                reject(filename, number, "card " + c.to_string() + " given twice");
+            hand.add(c);
+            i += len;
+        }
+        if (hand.size() != 13)
+            reject(filename, number, "a hand needs 13 cards, not " + std::to_string(hand.size()));
+        return hand;
+    }
+}
+
+std::vector<Deal> load_deals(const std::string &filename) {
+    Mapping file(filename);
+    Lines lines(file.view());
+    std::vector<Deal> deals;
+    std::string_view line;
+    while (lines.next(line)) {
+        Deal deal{};
+        if (line.size() != 2 || line[0] < '1' || line[0] > '7' ||
+            std::string_view("NESW").find(line[1]) == std::string_view::npos)
+            reject(filename, lines.get_number(), "expected a deal type (1-7) and a seat (N, E, S or W)");
+        deal.type = static_cast<uint8_t>(line[0] - '0');
+        deal.first = line[1];
+        uint64_t dealt = 0;
+        for (Hand &hand: deal.hands) {
+            if (!lines.next(line))
+                reject(filename, lines.get_number() + 1, "the deal has less than 4 hands");
+            hand = parse_hand(line, filename, lines.get_number());
+            if (dealt & hand.get_mask())
+                reject(filename, lines.get_number(), "a card is in more than one hand");
+            dealt |= hand.get_mask();
+        }
+        deals.push_back(deal);
+        if (lines.only_blank_left())
+            break;
+    }
+    if (deals.empty())
+        throw std::runtime_error(filename + ": no deals");
+    return deals;
+}
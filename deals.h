@@ -0,0 +1,24 @@
+#ifndef DEALS_H
+#define DEALS_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "card.h"
+
+// A deal from the description file: its type, the seat starting it and
+// the hands of N, E, S and W.
+struct Deal {
+    uint8_t type;
+    char first;
+    std::array<Hand, 4> hands;
+};
+
+// Reads the whole description at once (memory-mapped) and checks it: deal
+// types 1-7, valid seats and four hands of 13 cards making up a deck.
+// Throws std::runtime_error naming the first bad line.
+std::vector<Deal> load_deals(const std::string &filename);
+
+#endif //DEALS_H
@@ -0,0 +1,139 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <array>
+#include <cstdint>
+#include <span>
+
+#include "card.h"
+#include "deals.h"
+#include "frame.h"
+#include "rules.h"
+#include "trace.h"
+
+// The rules engine: a deal played card by card, with no sockets and no
+// threads. The server, the log replay and the simulator all build on it.
+
+// does playing c break the obligation to follow the suit of the trick
+[[nodiscard]] constexpr bool incorrect_color(const Hand &hand, std::span<const Card> trick, const Card &c) noexcept {
+    return !trick.empty() && trick[0].get_suit() != c.get_suit() && hand.has_suit(trick[0].get_suit());
+}
+
+// The state of a deal. Trivially copyable, so it can be published whole.
+class DealState {
+protected:
+    std::array<Hand, 4> hands;
+    int current_deal = 0;
+    char first_player = 'N';
+    char player = 'N';
+    std::array<std::array<Card, 4>, 13> tricks{};
+    std::array<uint8_t, 13> trick_sizes{};
+    std::array<char, 13> taken{};
+    std::array<int, 4> points_deal{};
+    std::array<int, 4> points_total{};
+    int current_trick = 0;
+    int points_left = 0; // still to be taken in the deal
+    int last_trick = 0;  // of the deal, 0 until it's over
+public:
+    [[nodiscard]] Hand get_hand(const int &pos) const noexcept {
+        return hands[pos];
+    }
+
+    // the cards pos holds when trick starts
+    [[nodiscard]] Hand get_hand_before(int pos, int trick) const noexcept {
+        Hand ans = hands[pos];
+        for (int i = 1; i < trick; i++)
+            for (const Card &c: get_trick(i))
+                ans.remove(c);
+        return ans;
+    }
+
+    [[nodiscard]] char get_first() const noexcept {
+        return first_player;
+    }
+
+    [[nodiscard]] int get_pos() const noexcept {
+        return get_index_from_seat(player);
+    }
+
+    [[nodiscard]] int get_deal() const noexcept {
+        return current_deal;
+    }
+
+    [[nodiscard]] int get_trick_no() const noexcept {
+        return current_trick + 1;
+    }
+
+    [[nodiscard]] bool is_deal_over() const noexcept {
+        return last_trick != 0;
+    }
+
+    // whether the deal ended with trick (so there's none after it)
+    [[nodiscard]] bool is_last_trick(int trick) const noexcept {
+        return trick == last_trick;
+    }
+
+    // points into this object: a snapshot must outlive what it returns
+    [[nodiscard]] std::span<const Card> get_trick(int trick) const noexcept {
+        return {tricks[trick - 1].data(), trick_sizes[trick - 1]};
+    }
+
+    [[nodiscard]] Frame get_TAKEN(int trick) const noexcept {
+        return frame_TAKEN(trick, get_trick(trick), taken[trick - 1]);
+    }
+
+    // points taken in the deal so far, by seat index
+    [[nodiscard]] const std::array<int, 4> &get_points() const noexcept {
+        return points_deal;
+    }
+
+    [[nodiscard]] Frame get_SCORE() const noexcept {
+        return frame_points("SCORE", points_deal);
+    }
+
+    [[nodiscard]] Frame get_TOTAL() const noexcept {
+        return frame_points("TOTAL", points_total);
+    }
+};
+
+// Plays deals: checks nothing about the cards (that's the caller's job),
+// just follows the tricks, who takes them and the points.
+class Engine : public DealState {
+public:
+    void start_deal(const Deal &deal) noexcept {
+        hands = deal.hands;
+        current_deal = deal.type;
+        first_player = player = deal.first;
+        current_trick = 0;
+        points_left = DEAL_POINTS[current_deal];
+        last_trick = 0;
+        points_deal = {};
+        trick_sizes = {};
+        taken = {};
+    }
+
+    void play(const Card &c) noexcept {
+        TRACE_SPAN("Engine::play");
+        auto &trick = tricks[current_trick];
+        trick[trick_sizes[current_trick]++] = c;
+        if (trick_sizes[current_trick] < 4)
+            return;
+        player = get_seat_from_index((get_pos() + trick_winner(trick.data())) % 4);
+        taken[current_trick] = player;
+        const auto &card_points = CARD_POINTS[current_deal];
+        int points = TRICK_POINTS[current_deal][current_trick];
+        for (const auto &card: trick)
+            points += card_points[card.get_code()];
+        points_deal[get_index_from_seat(player)] += points;
+        points_left -= points;
+        current_trick++;
+        // end of deal, there's no point in playing on once all points are taken
+        if (current_trick == 13 || points_left == 0) {
+            last_trick = current_trick;
+            for (int i = 0; i < 4; i++)
+                points_total[i] += points_deal[i];
+        }
+    }
+};
+
+#endif //ENGINE_H
@@ -0,0 +1,233 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cstddef>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <utility>
+
+#include "card.h"
+
+// An outgoing message formatted in place, so sending it allocates nothing.
+// Every message of the protocol fits: the longest, SCORE or TOTAL with
+// four 11-character numbers, takes 55 bytes. Whatever doesn't fit is cut off.
+class Frame {
+public:
+    static constexpr size_t CAPACITY = 64;
+private:
+    std::array<char, CAPACITY> buffer;
+    size_t len = 0;
+public:
+    Frame &operator<<(std::string_view s) noexcept {
+        size_t n = std::min(s.size(), CAPACITY - len);
+        std::copy_n(s.data(), n, buffer.data() + len);
+        len += n;
+        return *this;
+    }
+    Frame &operator<<(char c) noexcept {
+        if (len < CAPACITY)
+            buffer[len++] = c;
+        return *this;
+    }
+    Frame &operator<<(int n) noexcept {
+        auto [end, ec] = std::to_chars(buffer.data() + len, buffer.data() + CAPACITY, n);
+        if (ec == std::errc())
+            len = static_cast<size_t>(end - buffer.data());
+        return *this;
+    }
+    Frame &operator<<(const Card &c) noexcept {
+        return *this << c.text();
+    }
+    Frame &operator<<(std::span<const Card> cards) noexcept {
+        for (const Card &c: cards)
+            *this << c;
+        return *this;
+    }
+    Frame &operator<<(const Hand &hand) noexcept {
+        for (Card c: hand)
+            *this << c;
+        return *this;
+    }
+
+    [[nodiscard]] const char *data() const noexcept {
+        return buffer.data();
+    }
+    [[nodiscard]] size_t size() const noexcept {
+        return len;
+    }
+    [[nodiscard]] std::string_view view() const noexcept {
+        return {buffer.data(), len};
+    }
+};
+
+// A frame encoded once and sent to several seats. It is immutable and
+// reference counted, so send queues and logs hold it instead of copying
+// its bytes. Released frames are kept for reuse: broadcasting allocates
+// only until there are enough of them, and then a block at a time.
+class SharedFrame {
+public:
+    static constexpr size_t BLOCK = 64; // frames allocated together
+private:
+    Frame frame;
+    mutable std::atomic<uint32_t> refs{1};
+    mutable SharedFrame *next_free = nullptr;
+    static inline std::mutex pool_mutex;
+    static inline SharedFrame *pool = nullptr;
+
+    SharedFrame() = default;
+public:
+    SharedFrame(const SharedFrame &) = delete;
+    SharedFrame &operator=(const SharedFrame &) = delete;
+
+private:
+    // adds a block to the pool but for its first frame, which is returned
+    static SharedFrame *grow() {
+        // the block is never freed, its frames go around the pool
+        auto *block = new SharedFrame[BLOCK];
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        for (size_t i = 1; i < BLOCK; i++) {
+            block[i].next_free = pool;
+            pool = block + i;
+        }
+        return block;
+    }
+public:
+    // fills the pool up front with at least frames, so a game that never
+    // holds more doesn't allocate
+    static void reserve(size_t frames) {
+        for (size_t i = 0; i < frames; i += BLOCK)
+            grow()->release();
+    }
+
+    // a copy of frame, with a single reference
+    [[nodiscard]] static SharedFrame *make(const Frame &frame) {
+        SharedFrame *ans = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(pool_mutex);
+            if (pool != nullptr) {
+                ans = pool;
+                pool = pool->next_free;
+            }
+        }
+        if (ans == nullptr)
+            ans = grow();
+        ans->frame = frame;
+        ans->refs.store(1, std::memory_order_relaxed);
+        return ans;
+    }
+
+    void acquire() const noexcept {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release() const noexcept {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        next_free = pool;
+        pool = const_cast<SharedFrame *>(this);
+    }
+
+    [[nodiscard]] std::string_view view() const noexcept {
+        return frame.view();
+    }
+};
+
+// Holds a reference to a SharedFrame, like a shared_ptr would.
+class FrameRef {
+private:
+    const SharedFrame *frame = nullptr;
+public:
+    FrameRef() = default;
+    explicit FrameRef(const Frame &f) : frame(SharedFrame::make(f)) {}
+    FrameRef(const FrameRef &other) noexcept : frame(other.frame) {
+        if (frame != nullptr)
+            frame->acquire();
+    }
+    FrameRef(FrameRef &&other) noexcept : frame(other.frame) {
+        other.frame = nullptr;
+    }
+    FrameRef &operator=(FrameRef other) noexcept {
+        std::swap(frame, other.frame);
+        return *this;
+    }
+    ~FrameRef() {
+        if (frame != nullptr)
+            frame->release();
+    }
+
+    [[nodiscard]] const SharedFrame *get() const noexcept {
+        return frame;
+    }
+    [[nodiscard]] std::string_view view() const noexcept {
+        return frame != nullptr ? frame->view() : std::string_view();
+    }
+};
+
+// MESSAGES
+
+inline Frame frame_BUSY(std::string_view occupied) noexcept {
+    Frame f;
+    f << "BUSY" << occupied << "\r\n";
+    return f;
+}
+
+inline Frame frame_DEAL(int type, char first, const Hand &hand) noexcept {
+    Frame f;
+    f << "DEAL" << type << first << hand << "\r\n";
+    return f;
+}
+
+inline Frame frame_TRICK(int trick, std::span<const Card> cards) noexcept {
+    Frame f;
+    f << "TRICK" << trick << cards << "\r\n";
+    return f;
+}
+
+inline Frame frame_WRONG(int trick) noexcept {
+    Frame f;
+    f << "WRONG" << trick << "\r\n";
+    return f;
+}
+
+inline Frame frame_TAKEN(int trick, std::span<const Card> cards, char taker) noexcept {
+    Frame f;
+    f << "TAKEN" << trick << cards << taker << "\r\n";
+    return f;
+}
+
+// TOKEN or RESUME (name), the token as 16 lowercase hex digits
+inline Frame frame_token(std::string_view name, char seat, uint64_t token) noexcept {
+    constexpr char digits[] = "0123456789abcdef";
+    Frame f;
+    f << name << seat;
+    for (int shift = 60; shift >= 0; shift -= 4)
+        f << digits[token >> shift & 0xF];
+    f << "\r\n";
+    return f;
+}
+
+// a hand of a deal in progress, sent instead of DEAL to a resumed seat
+inline Frame frame_STATE(int type, char first, const Hand &hand) noexcept {
+    Frame f;
+    f << "STATE" << type << first << hand << "\r\n";
+    return f;
+}
+
+// SCORE or TOTAL (name) with points of N, E, S and W
+inline Frame frame_points(std::string_view name, const std::array<int, 4> &points) noexcept {
+    constexpr char seats[] = {'N', 'E', 'S', 'W'};
+    Frame f;
+    f << name;
+    for (int i = 0; i < 4; i++)
+        f << seats[i] << points[i];
+    f << "\r\n";
+    return f;
+}
+
+#endif //FRAME_H
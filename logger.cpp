@@ -0,0 +1,199 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "err.h"
+#include "frame.h"
+#include "logger.h"
+
+namespace {
+    constexpr size_t FLUSH_SIZE = 1 << 16;
+
+    bool before(const timespec &a, const timespec &b) noexcept {
+        return a.tv_sec != b.tv_sec ? a.tv_sec < b.tv_sec : a.tv_nsec < b.tv_nsec;
+    }
+}
+
+// LOG RING
+
+LogRing::LogRing(Logger &logger, std::string sender_receiver, std::string receiver_sender) :
+    logger(logger), sender_receiver(std::move(sender_receiver)),
+    receiver_sender(std::move(receiver_sender)) {}
+
+void LogRing::copy_in(size_t pos, const void *src, size_t len) noexcept {
+    pos &= CAPACITY - 1;
+    size_t first = std::min(len, CAPACITY - pos);
+    memcpy(data.data() + pos, src, first);
+    memcpy(data.data(), static_cast<const char *>(src) + first, len - first);
+}
+
+void LogRing::copy_out(size_t pos, void *dst, size_t len) const noexcept {
+    pos &= CAPACITY - 1;
+    size_t first = std::min(len, CAPACITY - pos);
+    memcpy(dst, data.data() + pos, first);
+    memcpy(static_cast<char *>(dst) + first, data.data(), len - first);
+}
+
+bool LogRing::peek(Header &header) const noexcept {
+    size_t pos = head.load(std::memory_order_relaxed);
+    if (tail.load(std::memory_order_acquire) == pos)
+        return false;
+    copy_out(pos, &header, sizeof header);
+    return true;
+}
+
+void LogRing::push(const Header &header, const char *msg) {
+    size_t need = sizeof header + header.len;
+    size_t pos = tail.load(std::memory_order_relaxed);
+    while (pos + need - head.load(std::memory_order_acquire) > CAPACITY) { // full
+        logger.wake();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    copy_in(pos, &header, sizeof header);
+    copy_in(pos + sizeof header, msg, header.len);
+    tail.store(pos + need, std::memory_order_release);
+}
+
+void LogRing::push(const timespec &t, bool send, std::string_view msg) {
+    push({.t = t, .len = static_cast<uint16_t>(std::min(msg.size(), CAPACITY / 2)), .send = send, .shared = nullptr},
+         msg.data());
+}
+
+void LogRing::push(const timespec &t, bool send, const SharedFrame &frame) {
+    frame.acquire();
+    push({.t = t, .len = 0, .send = send, .shared = &frame}, nullptr);
+}
+
+void LogRing::close() noexcept {
+    closed.store(true, std::memory_order_release);
+}
+
+// LOGGER
+
+Logger::Logger(const std::string &filename) :
+    out(filename.empty() ? stdout : fopen(filename.c_str(), "w")) {
+    if (out == nullptr)
+        syserr("cannot open log file");
+    buffer.reserve(FLUSH_SIZE + LogRing::CAPACITY); // it never grows past a flush and an entry
+    writer = std::thread(&Logger::run, this);
+}
+
+Logger::~Logger() {
+    stop();
+    if (out != stdout)
+        fclose(out);
+}
+
+std::shared_ptr<LogRing> Logger::open(std::string sender_receiver, std::string receiver_sender) {
+    auto ring = std::make_shared<LogRing>(*this, std::move(sender_receiver), std::move(receiver_sender));
+    std::unique_lock<std::mutex> lock(mutex);
+    opened.push_back(ring);
+    // the writer takes the ring now, while the connection is set up, not mid-game
+    woken = true;
+    cv.notify_one();
+    return ring;
+}
+
+void Logger::wake() noexcept {
+    std::unique_lock<std::mutex> lock(mutex);
+    woken = true;
+    cv.notify_one();
+}
+
+void Logger::stop() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+        cv.notify_one();
+    }
+    if (writer.joinable())
+        writer.join();
+}
+
+void Logger::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        bool last = stopping;
+        woken = false;
+        rings.insert(rings.end(), opened.begin(), opened.end());
+        opened.clear();
+        heads.reserve(rings.size()); // the merge doesn't allocate
+        lock.unlock();
+        timespec watermark{.tv_sec = std::numeric_limits<time_t>::max(), .tv_nsec = 0};
+        if (!last) {
+            clock_gettime(CLOCK_REALTIME, &watermark);
+            watermark.tv_nsec -= LATENESS_NS;
+            if (watermark.tv_nsec < 0) {
+                watermark.tv_sec--;
+                watermark.tv_nsec += 1'000'000'000;
+            }
+        }
+        drain(watermark);
+        lock.lock();
+        if (last)
+            return;
+        cv.wait_for(lock, FLUSH_INTERVAL, [this]{ return stopping || woken; });
+    }
+}
+
+void Logger::drain(const timespec &watermark) {
+    // k-way merge of the rings, each of them is already in timestamp order
+    heads.clear();
+    LogRing::Header header{};
+    for (size_t i = 0; i < rings.size(); i++)
+        if (rings[i]->peek(header))
+            heads.emplace_back(header.t, i);
+    auto later = [](const auto &a, const auto &b) { return before(b.first, a.first); };
+    std::ranges::make_heap(heads, later);
+    while (!heads.empty()) {
+        std::ranges::pop_heap(heads, later);
+        auto [t, i] = heads.back();
+        heads.pop_back();
+        if (before(watermark, t))
+            break;
+        LogRing &ring = *rings[i];
+        size_t pos = ring.head.load(std::memory_order_relaxed);
+        ring.peek(header);
+        format(ring, header, pos + sizeof header);
+        ring.head.store(pos + sizeof header + header.len, std::memory_order_release);
+        if (ring.peek(header)) {
+            heads.emplace_back(header.t, i);
+            std::ranges::push_heap(heads, later);
+        }
+        if (buffer.size() >= FLUSH_SIZE) {
+            fwrite(buffer.data(), 1, buffer.size(), out);
+            buffer.clear();
+        }
+    }
+    fwrite(buffer.data(), 1, buffer.size(), out);
+    fflush(out);
+    buffer.clear();
+    // closed is checked first: everything pushed before closing is visible then
+    std::erase_if(rings, [&header](const std::shared_ptr<LogRing> &ring) {
+        return ring->closed.load(std::memory_order_acquire) && !ring->peek(header);
+    });
+}
+
+void Logger::format(const LogRing &ring, const LogRing::Header &header, size_t pos) {
+    if (header.t.tv_sec != last_second) {
+        tm time{};
+        localtime_r(&header.t.tv_sec, &time);
+        strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%S", &time);
+        last_second = header.t.tv_sec;
+    }
+    auto ms = static_cast<int>(header.t.tv_nsec / 1'000'000);
+    const char millis[] = {'.', static_cast<char>('0' + ms / 100), static_cast<char>('0' + ms / 10 % 10),
+                           static_cast<char>('0' + ms % 10), ']', ' '};
+    buffer += '[';
+    buffer += header.send ? ring.sender_receiver : ring.receiver_sender;
+    buffer += date;
+    buffer.append(millis, sizeof millis);
+    if (header.shared != nullptr) {
+        buffer += header.shared->view();
+        header.shared->release();
+        return;
+    }
+    size_t start = buffer.size();
+    buffer.resize(start + header.len);
+    ring.copy_out(pos, buffer.data() + start, header.len);
+}
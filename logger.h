@@ -0,0 +1,97 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class Logger;
+class SharedFrame;
+
+// Log of a single connection: a single-producer single-consumer ring of
+// raw entries (timestamp, direction, message bytes or a shared frame).
+// Only the thread owning the connection pushes, only the logger's writer pops.
+class LogRing {
+private:
+    friend class Logger;
+    static constexpr size_t CAPACITY = 1 << 14; // must be a power of 2
+    struct Header {
+        timespec t;
+        uint16_t len;
+        bool send;
+        const SharedFrame *shared; // the message if not nullptr (len is 0 then)
+    };
+
+    Logger &logger;
+    // "<ip>:<port>,<ip>:<port>," of the sender and receiver, for both directions
+    const std::string sender_receiver;
+    const std::string receiver_sender;
+    std::array<char, CAPACITY> data;
+    alignas(64) std::atomic<size_t> head{0}; // moved by the writer
+    alignas(64) std::atomic<size_t> tail{0}; // moved by the producer
+    std::atomic<bool> closed{false};
+
+    void copy_in(size_t pos, const void *src, size_t len) noexcept;
+    void copy_out(size_t pos, void *dst, size_t len) const noexcept;
+    // waits for the writer if the ring is full
+    void push(const Header &header, const char *msg);
+    // writer's side: false if there is no complete entry
+    bool peek(Header &header) const noexcept;
+public:
+    LogRing(Logger &logger, std::string sender_receiver, std::string receiver_sender);
+    void push(const timespec &t, bool send, std::string_view msg);
+    // refers to the frame instead of copying it, the writer lets go of it
+    void push(const timespec &t, bool send, const SharedFrame &frame);
+    // no more entries will come, the writer drops the ring once it is empty
+    void close() noexcept;
+};
+
+// Writes all connections' logs in timestamp order while the game goes on.
+// Entries are formatted only here; memory is bounded by the rings.
+class Logger {
+private:
+    // entries this fresh may still be overtaken by ones not pushed yet
+    static constexpr long LATENESS_NS = 50'000'000;
+    static constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(10);
+
+    FILE *out;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+    bool woken = false; // a producer waits for space in its ring
+    std::vector<std::shared_ptr<LogRing>> opened; // not seen by the writer yet
+    std::vector<std::shared_ptr<LogRing>> rings;  // owned by the writer
+    std::string buffer;
+    std::vector<std::pair<timespec, size_t>> heads; // of the merge, kept between drains
+    time_t last_second = -1;
+    char date[32]{};
+    std::thread writer;
+
+    void run();
+    // writes entries up to the watermark and drops finished rings
+    void drain(const timespec &watermark);
+    void format(const LogRing &ring, const LogRing::Header &header, size_t pos);
+public:
+    // logs to the file, or to stdout if filename is empty
+    explicit Logger(const std::string &filename = "");
+    ~Logger();
+    Logger(const Logger &) = delete;
+    Logger &operator=(const Logger &) = delete;
+
+    [[nodiscard]] std::shared_ptr<LogRing> open(std::string sender_receiver, std::string receiver_sender);
+    void wake() noexcept;
+    // writes everything that is left and stops the writer
+    void stop();
+};
+
+#endif //LOGGER_H
@@ -0,0 +1,103 @@
+#include "metrics.h"
+
+#include <cerrno>
+#include <sstream>
+#include <poll.h>
+#include <unistd.h>
+
+namespace {
+    constexpr auto REQUEST_TIMEOUT = std::chrono::seconds(1);
+    constexpr size_t MAX_REQUEST = 4096;
+
+    void header(std::ostringstream &out, const char *name, const char *type, const char *help) {
+        out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+    }
+
+    template <class T>
+    void single(std::ostringstream &out, const char *name, const char *type, const char *help,
+                const std::atomic<T> &value) {
+        header(out, name, type, help);
+        out << name << ' ' << value.load(std::memory_order_relaxed) << '\n';
+    }
+
+    template <size_t N>
+    void histogram(std::ostringstream &out, const char *name, const char *help, const Histogram<N> &h) {
+        header(out, name, "histogram", help);
+        uint64_t total = 0;
+        for (size_t i = 0; i < N; i++) {
+            total += h.bucket(i);
+            out << name << "_bucket{le=\"" << h.bound(i) << "\"} " << total << '\n';
+        }
+        total += h.bucket(N);
+        out << name << "_bucket{le=\"+Inf\"} " << total << '\n'
+            << name << "_sum " << h.sum() << '\n'
+            << name << "_count " << total << '\n';
+    }
+
+    // waits for the socket to be ready, but not past the deadline
+    bool wait_for(int fd, short events, Metrics::Clock::time_point deadline) {
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - Metrics::Clock::now());
+        if (left.count() <= 0)
+            return false;
+        pollfd pfd = {.fd = fd, .events = events, .revents = 0};
+        return poll(&pfd, 1, static_cast<int>(left.count())) > 0;
+    }
+
+    void write_all(int fd, const std::string &s, Metrics::Clock::time_point deadline) {
+        size_t done = 0;
+        while (done < s.size()) {
+            ssize_t n = write(fd, s.data() + done, s.size() - done);
+            if (n < 0 && errno == EAGAIN && wait_for(fd, POLLOUT, deadline))
+                continue;
+            if (n <= 0)
+                return;
+            done += static_cast<size_t>(n);
+        }
+    }
+}
+
+std::string Metrics::render() const {
+    std::ostringstream out;
+    single(out, "kierki_connections", "gauge", "Open player connections.", connections);
+    single(out, "kierki_connections_total", "counter", "Player connections accepted.", connections_total);
+    single(out, "kierki_busy_total", "counter", "Connections rejected with BUSY.", busy);
+    single(out, "kierki_rejected_total", "counter", "Connections closed at once: over the cap or too many half-open from the address.", rejected);
+    single(out, "kierki_wrong_total", "counter", "WRONG messages sent.", wrong);
+    single(out, "kierki_trick_retries_total", "counter", "TRICK sent again after a timeout.", trick_retries);
+    single(out, "kierki_pauses_total", "counter", "Games paused for a missing player.", pauses);
+    single(out, "kierki_resumes_total", "counter", "Paused games resumed.", resumes);
+    single(out, "kierki_received_bytes_total", "counter", "Bytes received from players.", bytes_received);
+    single(out, "kierki_sent_bytes_total", "counter", "Bytes sent to players.", bytes_sent);
+    histogram(out, "kierki_move_latency_seconds", "From TRICK sent to a correct card received.", move_latency);
+    histogram(out, "kierki_deal_duration_seconds", "From the first TRICK to the last TAKEN of a deal.",
+              deal_duration);
+    return out.str();
+}
+
+void serve_metrics(int client_fd, const Metrics &metrics) {
+    // the request line is all we need, the rest of the headers may follow it;
+    // the whole scrape gets one deadline, so a slow client can't hold the caller
+    const auto deadline = Metrics::Clock::now() + REQUEST_TIMEOUT;
+    std::string request;
+    char buffer[512];
+    while (request.find("\r\n") == std::string::npos && request.size() < MAX_REQUEST) {
+        if (!wait_for(client_fd, POLLIN, deadline))
+            break;
+        ssize_t n = read(client_fd, buffer, sizeof buffer);
+        if (n < 0 && errno == EAGAIN)
+            continue;
+        if (n <= 0)
+            break;
+        request.append(buffer, static_cast<size_t>(n));
+    }
+    std::string status = "404 Not Found", body = "not found\n";
+    if (request.starts_with("GET /metrics ") || request.starts_with("GET /metrics?")) {
+        status = "200 OK";
+        body = metrics.render();
+    }
+    write_all(client_fd, "HTTP/1.1 " + status + "\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                         "Connection: close\r\n\r\n" + body, deadline);
+    close(client_fd);
+}
@@ -0,0 +1,78 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Observations by bucket: a bucket counts the ones up to its bound (in
+// seconds) and above the previous one, the last one counts the rest.
+template <size_t N>
+class Histogram {
+private:
+    const std::array<double, N> bounds;
+    std::array<std::atomic<uint64_t>, N + 1> buckets{};
+    std::atomic<uint64_t> sum_ns{0};
+public:
+    explicit Histogram(const std::array<double, N> &bounds) : bounds(bounds) {}
+
+    void observe(std::chrono::nanoseconds t) noexcept {
+        double seconds = std::chrono::duration<double>(t).count();
+        size_t i = 0;
+        while (i < N && seconds > bounds[i])
+            i++;
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        sum_ns.fetch_add(static_cast<uint64_t>(t.count()), std::memory_order_relaxed);
+    }
+
+    [[nodiscard]] static constexpr size_t size() noexcept {
+        return N;
+    }
+    [[nodiscard]] double bound(size_t i) const noexcept {
+        return bounds[i];
+    }
+    // i == size() is the one above all bounds
+    [[nodiscard]] uint64_t bucket(size_t i) const noexcept {
+        return buckets[i].load(std::memory_order_relaxed);
+    }
+    [[nodiscard]] double sum() const noexcept {
+        return static_cast<double>(sum_ns.load(std::memory_order_relaxed)) / 1e9;
+    }
+};
+
+// Counters of the whole server, updated by every thread (relaxed: they are
+// only ever read by the metrics listener) and served by it as text.
+class Metrics {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    std::atomic<int64_t> connections{0}; // open now
+    std::atomic<uint64_t> connections_total{0};
+    std::atomic<uint64_t> busy{0};
+    std::atomic<uint64_t> rejected{0}; // closed at once: over the cap or too many half-open from the address
+    std::atomic<uint64_t> wrong{0};
+    std::atomic<uint64_t> trick_retries{0}; // TRICK sent again after a timeout
+    std::atomic<uint64_t> pauses{0};
+    std::atomic<uint64_t> resumes{0};
+    std::atomic<uint64_t> bytes_received{0};
+    std::atomic<uint64_t> bytes_sent{0};
+    // TRICK sent -> correct card received
+    Histogram<12> move_latency{{0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+                                0.01, 0.025, 0.05, 0.1, 1, 5}};
+    // first TRICK -> last TAKEN
+    Histogram<10> deal_duration{{0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 1, 10, 60}};
+
+    [[nodiscard]] std::string render() const;
+};
+
+inline void count(std::atomic<uint64_t> &counter, uint64_t n = 1) noexcept {
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+// answers a single HTTP request on the non-blocking client_fd (GET /metrics),
+// giving up after a second, and closes it
+void serve_metrics(int client_fd, const Metrics &metrics);
+
+#endif //METRICS_H
@@ -1,6 +1,8 @@
 #ifndef SERVER_PARSER
 #define SERVER_PARSER
 
+#include <algorithm>
+#include <string>
 #include <sys/socket.h>
 #include <unistd.h>
 #include "err.h"
@@ -9,6 +11,16 @@ struct server_config {
     int port = 0;
     std::string filename;
     int timeout = 5;
+    size_t tables = 1;
+    size_t loops = 0; // event loops, 0 means a thread per player
+    std::string log_file; // empty means stdout
+    bool cork = false; // TCP_CORK around bursts of messages
+    int metrics_port = -1; // of the HTTP metrics listener, -1 means none
+    size_t acceptors = 1; // threads accepting clients, each on its own SO_REUSEPORT socket
+    int backlog = SOMAXCONN; // of every listening socket
+    // open at once, the rest is closed right away; 0 means no limit, else at least a seat's worth
+    size_t max_connections = 1024; // raised to 4 * tables if that's more
+    size_t half_open = 32; // connections per address before IAM, 0 means no limit
 };
 
 struct client_config {
@@ -17,33 +29,53 @@ struct client_config {
     int ipv = AF_UNSPEC;
     char seat = 0;
     bool auto_player = false;
+    std::string strategy = "heuristic"; // of the automatic player
+    int budget = 200; // ms per move, for the Monte Carlo strategy
+    unsigned threads = 0; // of the Monte Carlo strategy, 0 means one per core
+    std::string token; // sent in RESUME instead of IAM, empty means none, zeros ask for a new seat
 };
 
 namespace details {
-    [[noreturn]] void usage_server() {
+    [[noreturn]] inline void usage_server() {
         fatal("possible options:\n"
             "\t\t-p <value> port (optional, default: chosen automatically)\n"
             "\t\t-f <value> file (required)\n"
-            "\t\t-t <value> timeout (optional, default: 5)\n");
+            "\t\t-t <value> timeout (optional, default: 5)\n"
+            "\t\t-n <value> number of tables (optional, default: 1)\n"
+            "\t\t-e <value> number of event loops (optional, default: 0 - thread per player)\n"
+            "\t\t-l <value> log file (optional, default: standard output)\n"
+            "\t\t-c cork bursts of messages (optional)\n"
+            "\t\t-m <value> port of the metrics listener, 0 - chosen automatically (optional, default: none)\n"
+            "\t\t-a <value> number of acceptor threads (optional, default: 1)\n"
+            "\t\t-b <value> backlog of the listening sockets (optional, default: SOMAXCONN)\n"
+            "\t\t-x <value> maximum number of open connections, at least 4 per table, 0 - no limit\n"
+            "\t\t   (optional, default: 1024 or 4 per table, whichever is more)\n"
+            "\t\t-o <value> connections per address not past IAM yet, 0 - no limit (optional, default: 32)\n");
     }
 
-    [[noreturn]] void usage_client() {
+    [[noreturn]] inline void usage_client() {
         fatal("possible options:\n"
               "\t\t-h <value> host (required)\n"
               "\t\t-p <value> port (required)\n"
               "\t\t-4 use IPv4 (optional)\n"
               "\t\t-6 use IPv6 (optional)\n"
               "\t\t-N/-E/-S/-W (required one of these)\n"
-              "\t\t-a play automatically (optional)\n");
+              "\t\t-a play automatically (optional)\n"
+              "\t\t-s <value> strategy of -a: lowest, heuristic or mc (optional, default: heuristic)\n"
+              "\t\t-b <value> time per move in ms for mc (optional, default: 200)\n"
+              "\t\t-j <value> threads for mc (optional, default: one per core)\n"
+              "\t\t-k ask the server for a token to resume the seat with (optional)\n"
+              "\t\t-r <value> resume the seat with the token from a previous connection (optional)\n");
     }
 }
 
 // in case of multiple declarations last one is chosen
-server_config get_server_config (int argc, char *argv[]) {
+inline server_config get_server_config (int argc, char *argv[]) {
     server_config ans;
     int opt;
     bool file_set = false;
-    while ((opt = getopt(argc, argv, "p:f:t:")) != -1) {
+    bool cap_set = false;
+    while ((opt = getopt(argc, argv, "p:f:t:n:e:l:cm:a:b:x:o:")) != -1) {
         switch (opt) {
             case 'p':
                 ans.port = std::stoi(optarg);
@@ -55,23 +87,70 @@ server_config get_server_config (int argc, char *argv[]) {
             case 't':
                 ans.timeout = std::stoi(optarg);
                 break;
+            case 'n':
+                if (std::stoi(optarg) <= 0)
+                    details::usage_server();
+                ans.tables = std::stoul(optarg);
+                break;
+            case 'e':
+                if (std::stoi(optarg) < 0)
+                    details::usage_server();
+                ans.loops = std::stoul(optarg);
+                break;
+            case 'l':
+                ans.log_file = std::string(optarg);
+                break;
+            case 'c':
+                ans.cork = true;
+                break;
+            case 'm':
+                if (std::stoi(optarg) < 0)
+                    details::usage_server();
+                ans.metrics_port = std::stoi(optarg);
+                break;
+            case 'a':
+                if (std::stoi(optarg) <= 0)
+                    details::usage_server();
+                ans.acceptors = std::stoul(optarg);
+                break;
+            case 'b':
+                if (std::stoi(optarg) <= 0)
+                    details::usage_server();
+                ans.backlog = std::stoi(optarg);
+                break;
+            case 'x':
+                if (std::stoi(optarg) < 0)
+                    details::usage_server();
+                ans.max_connections = std::stoul(optarg);
+                cap_set = true;
+                break;
+            case 'o':
+                if (std::stoi(optarg) < 0)
+                    details::usage_server();
+                ans.half_open = std::stoul(optarg);
+                break;
             default:
                 details::usage_server();
         }
     }
     if (!file_set)
         details::usage_server();
+    // below a connection per seat some tables could never start
+    if (!cap_set)
+        ans.max_connections = std::max(ans.max_connections, 4 * ans.tables);
+    else if (ans.max_connections != 0 && ans.max_connections < 4 * ans.tables)
+        details::usage_server();
     return ans;
 }
 
 // in case of multiple declarations last one is chosen
-client_config get_client_config (int argc, char *argv[]) {
+inline client_config get_client_config (int argc, char *argv[]) {
     client_config ans;
     int opt;
     bool host_set = false;
     bool port_set = false;
     bool seat_set = false;
-    while ((opt = getopt(argc, argv, "h:p:46NESWa")) != -1) {
+    while ((opt = getopt(argc, argv, "h:p:46NESWas:b:j:kr:")) != -1) {
         switch (opt) {
             case 'h':
                 ans.host = optarg;
@@ -97,6 +176,28 @@ client_config get_client_config (int argc, char *argv[]) {
             case 'a':
                 ans.auto_player = true;
                 break;
+            case 's':
+                ans.strategy = optarg;
+                break;
+            case 'b':
+                if (std::stoi(optarg) <= 0)
+                    details::usage_client();
+                ans.budget = std::stoi(optarg);
+                break;
+            case 'j':
+                if (std::stoi(optarg) < 0)
+                    details::usage_client();
+                ans.threads = std::stoul(optarg);
+                break;
+            case 'k':
+                if (ans.token.empty())
+                    ans.token = std::string(16, '0');
+                break;
+            case 'r':
+                ans.token = optarg;
+                if (ans.token.size() != 16 || ans.token.find_first_not_of("0123456789abcdef") != std::string::npos)
+                    details::usage_client();
+                break;
             default:
                 details::usage_client();
         }
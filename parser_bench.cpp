@@ -0,0 +1,206 @@
+// Microbenchmark of the protocol parser against the regexes it replaced.
+// Before timing anything it checks that both accept and reject the same
+// messages and extract the same fields.
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+
+namespace reference {
+    constexpr std::string multiply_string(const std::string &input, int times) {
+        std::string ans;
+        while (times--)
+            ans += input;
+        return ans;
+    }
+
+    const std::string CARD_REGEX("((?:[1-9]|10|Q|J|K|A)(?:[CDHS]))");
+    const std::regex BUSY_REGEX("BUSY" + multiply_string("([NESW])?", 4) + "\r\n");
+    const std::regex DEAL_REGEX ("DEAL([1-7])([NESW])" + multiply_string(CARD_REGEX, 13) + "\r\n");
+    const std::regex TRICK_REGEX ("TRICK([1-9]|1[0-3])" +
+                                  multiply_string(CARD_REGEX + '?', 4) + "\r\n");
+    const std::regex WRONG_REGEX ("WRONG([1-9|1[0-3])\r\n");
+    const std::regex TAKEN_REGEX ("TAKEN([1-9]|1[0-3])" +
+                                  multiply_string(CARD_REGEX, 4) + "([NESW])\r\n");
+    const std::regex SCORE_REGEX("SCORE" + multiply_string("([NESW])(\\d+)", 4) + "\r\n");
+    const std::regex TOTAL_REGEX("TOTAL" + multiply_string("([NESW])(\\d+)", 4) + "\r\n");
+    constexpr int REGEXES_NO = 7;
+    const std::regex regexes[REGEXES_NO] = {BUSY_REGEX, DEAL_REGEX,
+                                            TRICK_REGEX, WRONG_REGEX,
+                                            TAKEN_REGEX, SCORE_REGEX,
+                                            TOTAL_REGEX};
+
+    // what the client used to do: find the type, then match again for the groups
+    int classify(const std::string &s, std::smatch &matches) {
+        for (int i = 0; i < REGEXES_NO; i++) {
+            if (std::regex_match(s, regexes[i])) {
+                std::regex_match(s, matches, regexes[i]);
+                return i;
+            }
+        }
+        return INCORRECT;
+    }
+}
+
+// Builds a random message of the given type, valid or not.
+std::string random_message(std::mt19937 &rng) {
+    static const char *values[] = {"2", "3", "4", "5", "6", "7", "8", "9", "10", "J", "Q", "K", "A", "1"};
+    static const char *seats = "NESW";
+    static const char *suits = "CDHS";
+    auto pick = [&rng](int n) { return static_cast<int>(rng() % n); };
+    auto card = [&]() {
+        // "1" (not a card, but matched by the old regex) only now and then
+        return std::string(values[pick(pick(40) == 0 ? 14 : 13)]) + suits[pick(4)];
+    };
+    auto cards = [&](int n) {
+        std::string ans;
+        while (n--)
+            ans += card();
+        return ans;
+    };
+    std::string s;
+    switch (pick(8)) {
+        case 0:
+            s = "BUSY";
+            for (int i = pick(6); i > 0; i--)
+                s += seats[pick(4)];
+            break;
+        case 1:
+            s = "DEAL" + std::to_string(pick(9)) + seats[pick(4)] + cards(12 + pick(3));
+            break;
+        case 2:
+            s = "TRICK" + std::to_string(pick(15)) + cards(pick(6));
+            break;
+        case 3:
+            s = "WRONG" + (pick(4) == 0 ? std::string(1, "|[x"[pick(3)]) : std::to_string(pick(15)));
+            break;
+        case 4:
+            s = "TAKEN" + std::to_string(pick(15)) + cards(3 + pick(3)) + seats[pick(4)];
+            break;
+        case 5:
+        case 6:
+            s = pick(2) ? "SCORE" : "TOTAL";
+            for (int i = 3 + pick(3); i > 0; i--)
+                s += seats[pick(4)] + std::to_string(pick(4) == 0 ? rng() : rng() % 30);
+            break;
+        default:
+            s = "IAM" + std::string(1, seats[pick(4)]);
+    }
+    s += "\r\n";
+    // and some noise
+    if (pick(6) == 0 && !s.empty())
+        s[pick(static_cast<int>(s.size()))] = "1023NCX\r\n "[pick(10)];
+    if (pick(10) == 0)
+        s.erase(pick(static_cast<int>(s.size())), 1);
+    return s;
+}
+
+// Returns an empty string if both parsers agree, the difference otherwise.
+std::string compare(const std::string &s) {
+    std::smatch matches;
+    int type = reference::classify(s, matches);
+    std::vector<Card> cards;
+    try {
+        if (type == DEAL || type == TRICK || type == TAKEN) {
+            size_t first = type == DEAL ? 3 : 2;
+            size_t last = type == TAKEN ? matches.size() - 1 : matches.size();
+            for (size_t i = first; i < last && !matches[i].str().empty(); i++)
+                cards.emplace_back(matches[i].str());
+        }
+    }
+    catch (const std::invalid_argument &) {
+        type = INCORRECT; // the old code couldn't build a Card either
+        cards.clear();
+    }
+    Message msg;
+    parse_message(s, msg);
+    if (msg.type != type)
+        return "type " + std::to_string(msg.type) + " vs " + std::to_string(type);
+    switch (type) {
+        case DEAL:
+        case TRICK:
+        case WRONG:
+        case TAKEN:
+            if (msg.number_text != matches[1].str())
+                return "number";
+            break;
+        case BUSY:
+            for (size_t i = 1; i < matches.size(); i++)
+                if (matches[i].str() != (i <= msg.seats_no ? std::string(1, msg.seats[i - 1]) : ""))
+                    return "seats";
+            break;
+        case SCORE:
+        case TOTAL:
+            for (int i = 0; i < 4; i++)
+                if (matches[1 + 2 * i].str()[0] != msg.seats[i] || matches[2 + 2 * i].str() != msg.points[i])
+                    return "points";
+            break;
+        default:
+            break;
+    }
+    if (cards.size() != msg.cards_no)
+        return "cards number";
+    for (size_t i = 0; i < cards.size(); i++)
+        if (!(cards[i] == msg.cards[i]))
+            return "cards";
+    if ((type == DEAL && matches[2].str()[0] != msg.seat) ||
+        (type == TAKEN && matches[matches.size() - 1].str()[0] != msg.seat))
+        return "seat";
+    return "";
+}
+
+int main(int argc, char *argv[]) {
+    size_t corpus_size = argc > 1 ? std::stoul(argv[1]) : 20000;
+    std::mt19937 rng(2024);
+    std::vector<std::string> corpus = {
+        "TRICK110C\r\n", "TRICK11C\r\n", "TRICK12C\r\n", "TRICK1010C\r\n", "TRICK13\r\n",
+        "TRICK14\r\n", "TRICK0\r\n", "WRONG10\r\n", "WRONG|\r\n", "WRONG[\r\n", "BUSY\r\n",
+        "BUSYNNNN\r\n", "BUSYNESWN\r\n", "TAKEN1310C10D10H10SN\r\n", "SCOREN0E00S1W99999999999999999999\r\n",
+    };
+    while (corpus.size() < corpus_size)
+        corpus.push_back(random_message(rng));
+
+    size_t accepted = 0;
+    for (const auto &s: corpus) {
+        std::string diff = compare(s);
+        if (!diff.empty()) {
+            std::cerr << "MISMATCH (" << diff << ") on: " << s << '\n';
+            return 1;
+        }
+        Message msg;
+        accepted += parse_message(s, msg);
+    }
+    std::cout << corpus.size() << " messages (" << accepted << " correct): parser and regexes agree\n";
+
+    using clock = std::chrono::steady_clock;
+    int rounds = 5;
+    size_t sink = 0;
+    auto start = clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (const auto &s: corpus) {
+            std::smatch matches;
+            sink += reference::classify(s, matches);
+        }
+    }
+    double regex_ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    start = clock::now();
+    for (int r = 0; r < rounds * 20; r++) {
+        for (const auto &s: corpus) {
+            Message msg;
+            parse_message(s, msg);
+            sink += msg.type;
+        }
+    }
+    double parser_ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    double n = static_cast<double>(corpus.size());
+    regex_ns /= n * rounds;
+    parser_ns /= n * rounds * 20;
+    std::cout << "regex:  " << regex_ns << " ns/message\n"
+              << "parser: " << parser_ns << " ns/message (" << regex_ns / parser_ns << "x faster)\n"
+              << "(checksum " << sink << ")\n";
+    return 0;
+}
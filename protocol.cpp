@@ -0,0 +1,236 @@
+#include "protocol.h"
+#include "trace.h"
+
+namespace {
+    constexpr int suit_index(char c) noexcept {
+        switch (c) {
+            case 'C': return 0;
+            case 'D': return 1;
+            case 'H': return 2;
+            case 'S': return 3;
+            default: return -1;
+        }
+    }
+
+    constexpr bool is_seat(char c) noexcept {
+        return c == 'N' || c == 'E' || c == 'S' || c == 'W';
+    }
+
+    constexpr bool is_digit(char c) noexcept {
+        return c >= '0' && c <= '9';
+    }
+
+    constexpr int hex_digit(char c) noexcept {
+        if (is_digit(c))
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        return -1;
+    }
+}
+
+size_t parse_card(std::string_view s, size_t i, Card &card) noexcept {
+    if (i + 1 >= s.size())
+        return 0;
+    int value;
+    size_t len = 2;
+    char c = s[i];
+    if (c >= '2' && c <= '9')
+        value = c - '2';
+    else if (c == '1') {
+        // "1<suit>" was a card for the regex, but not for Card
+        if (s[i + 1] != '0' || i + 2 >= s.size())
+            return 0;
+        value = 8;
+        len = 3;
+    }
+    else if (c == 'J')
+        value = 9;
+    else if (c == 'Q')
+        value = 10;
+    else if (c == 'K')
+        value = 11;
+    else if (c == 'A')
+        value = 12;
+    else
+        return 0;
+    int suit = suit_index(s[i + len - 1]);
+    if (suit < 0)
+        return 0;
+    card = Card(value, suit);
+    return len;
+}
+
+namespace {
+    // Reads up to max cards starting at s[i], moves i past them.
+    uint8_t parse_cards(std::string_view s, size_t &i, Message &msg, uint8_t max) noexcept {
+        uint8_t n = 0;
+        while (n < max) {
+            size_t len = parse_card(s, i, msg.cards[n]);
+            if (len == 0)
+                break;
+            i += len;
+            n++;
+        }
+        return n;
+    }
+
+    constexpr bool is_end(std::string_view s, size_t i) noexcept {
+        return s.size() == i + 2 && s[i] == '\r' && s[i + 1] == '\n';
+    }
+
+    // Trick number as in "([1-9]|1[0-3])": the regex tries the single digit
+    // first, so for every possible length (1 or 2) rest is called in this
+    // order until it succeeds.
+    template <class F>
+    bool parse_trick_no(std::string_view s, size_t i, Message &msg, F rest) noexcept {
+        if (i >= s.size() || s[i] < '1' || s[i] > '9')
+            return false;
+        msg.number = s[i] - '0';
+        msg.number_text = s.substr(i, 1);
+        if (rest(i + 1))
+            return true;
+        if (s[i] != '1' || i + 1 >= s.size() || s[i + 1] < '0' || s[i + 1] > '3')
+            return false;
+        msg.number = 10 + s[i + 1] - '0';
+        msg.number_text = s.substr(i, 2);
+        return rest(i + 2);
+    }
+
+    bool parse_BUSY(std::string_view s, Message &msg) noexcept {
+        size_t i = 4;
+        while (i < s.size() && msg.seats_no < 4 && is_seat(s[i]))
+            msg.seats[msg.seats_no++] = s[i++];
+        return is_end(s, i);
+    }
+
+    bool parse_DEAL(std::string_view s, Message &msg) noexcept {
+        if (s.size() < 6 || s[4] < '1' || s[4] > '7' || !is_seat(s[5]))
+            return false;
+        msg.number = s[4] - '0';
+        msg.number_text = s.substr(4, 1);
+        msg.seat = s[5];
+        size_t i = 6;
+        msg.cards_no = parse_cards(s, i, msg, 13);
+        return msg.cards_no == 13 && is_end(s, i);
+    }
+
+    // all of a hand but the tricks taken, so between 1 and 12 cards
+    bool parse_STATE(std::string_view s, Message &msg) noexcept {
+        if (s.size() < 7 || s[5] < '1' || s[5] > '7' || !is_seat(s[6]))
+            return false;
+        msg.number = s[5] - '0';
+        msg.number_text = s.substr(5, 1);
+        msg.seat = s[6];
+        size_t i = 7;
+        msg.cards_no = parse_cards(s, i, msg, 12);
+        return msg.cards_no > 0 && is_end(s, i);
+    }
+
+    // the seat at s[i], then the token (0 in a RESUME asking for a new seat)
+    bool parse_token(std::string_view s, size_t i, char &seat, uint64_t &token) noexcept {
+        if (s.size() != i + 1 + TOKEN_DIGITS + 2 || !is_seat(s[i]) || !is_end(s, i + 1 + TOKEN_DIGITS))
+            return false;
+        seat = s[i];
+        token = 0;
+        for (size_t k = i + 1; k < i + 1 + TOKEN_DIGITS; k++) {
+            int d = hex_digit(s[k]);
+            if (d < 0)
+                return false;
+            token = token << 4 | static_cast<uint64_t>(d);
+        }
+        return true;
+    }
+
+    bool parse_trick(std::string_view s, Message &msg) noexcept {
+        return parse_trick_no(s, 5, msg, [&s, &msg](size_t i) {
+            msg.cards_no = parse_cards(s, i, msg, 4);
+            return is_end(s, i);
+        });
+    }
+
+    bool parse_TAKEN(std::string_view s, Message &msg) noexcept {
+        return parse_trick_no(s, 5, msg, [&s, &msg](size_t i) {
+            msg.cards_no = parse_cards(s, i, msg, 4);
+            if (msg.cards_no != 4 || i >= s.size() || !is_seat(s[i]))
+                return false;
+            msg.seat = s[i];
+            return is_end(s, i + 1);
+        });
+    }
+
+    // Mirrors WRONG_REGEX as it was written: "([1-9|1[0-3])" is a single
+    // character class, so it takes one character out of "0-9", '|' and '['.
+    bool parse_WRONG(std::string_view s, Message &msg) noexcept {
+        if (s.size() < 6 || !(is_digit(s[5]) || s[5] == '|' || s[5] == '['))
+            return false;
+        msg.number = is_digit(s[5]) ? s[5] - '0' : -1;
+        msg.number_text = s.substr(5, 1);
+        return is_end(s, 6);
+    }
+
+    bool parse_points(std::string_view s, Message &msg) noexcept {
+        size_t i = 5;
+        for (msg.seats_no = 0; msg.seats_no < 4; msg.seats_no++) {
+            if (i >= s.size() || !is_seat(s[i]))
+                return false;
+            msg.seats[msg.seats_no] = s[i++];
+            size_t start = i;
+            while (i < s.size() && is_digit(s[i]))
+                i++;
+            if (i == start)
+                return false;
+            msg.points[msg.seats_no] = s.substr(start, i - start);
+        }
+        return is_end(s, i);
+    }
+
+    bool finish(Message &msg, int type, bool ok) noexcept {
+        if (ok)
+            msg.type = type;
+        else
+            msg = Message{};
+        return ok;
+    }
+}
+
+bool parse_message(std::string_view s, Message &msg) {
+    TRACE_SPAN("parse_message");
+    msg = Message{};
+    if (s.starts_with("BUSY"))
+        return finish(msg, BUSY, parse_BUSY(s, msg));
+    if (s.starts_with("DEAL"))
+        return finish(msg, DEAL, parse_DEAL(s, msg));
+    if (s.starts_with("TRICK"))
+        return finish(msg, TRICK, parse_trick(s, msg));
+    if (s.starts_with("WRONG"))
+        return finish(msg, WRONG, parse_WRONG(s, msg));
+    if (s.starts_with("TAKEN"))
+        return finish(msg, TAKEN, parse_TAKEN(s, msg));
+    if (s.starts_with("SCORE"))
+        return finish(msg, SCORE, parse_points(s, msg));
+    if (s.starts_with("TOTAL"))
+        return finish(msg, TOTAL, parse_points(s, msg));
+    if (s.starts_with("TOKEN"))
+        return finish(msg, TOKEN, parse_token(s, 5, msg.seat, msg.token) && msg.token != 0);
+    if (s.starts_with("STATE"))
+        return finish(msg, STATE, parse_STATE(s, msg));
+    return false;
+}
+
+bool parse_TRICK(std::string_view s, Message &msg) {
+    TRACE_SPAN("parse_TRICK");
+    msg = Message{};
+    return finish(msg, TRICK, s.starts_with("TRICK") && parse_trick(s, msg));
+}
+
+bool parse_IAM(std::string_view s, char &seat) {
+    if (s.size() != 6 || !s.starts_with("IAM") || !is_seat(s[3]) || !is_end(s, 4))
+        return false;
+    seat = s[3];
+    return true;
+}
+
+bool parse_RESUME(std::string_view s, char &seat, uint64_t &token) {
+    return s.starts_with("RESUME") && parse_token(s, 6, seat, token);
+}
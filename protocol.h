@@ -0,0 +1,66 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#include "card.h"
+
+// MESSAGE IDS
+
+constexpr int BUSY = 0;
+constexpr int DEAL = BUSY + 1; // 1
+constexpr int TRICK = DEAL + 1; // 2
+constexpr int WRONG = TRICK + 1; // 3
+constexpr int TAKEN = WRONG + 1; // 4
+constexpr int SCORE = TAKEN + 1; // 5
+constexpr int TOTAL = SCORE + 1; // 6
+// extensions, ignored by clients that don't know them (as any bad message)
+constexpr int TOKEN = TOTAL + 1; // 7
+constexpr int STATE = TOKEN + 1; // 8
+constexpr int INCORRECT = STATE + 1; // 9
+
+// TOKEN<seat><token>: the seat's resumption token, as 16 hex digits, sent
+// only to a client that asked for it with RESUME<seat>0000000000000000
+// instead of IAM (a plain IAM is answered as in the original protocol). A
+// client coming back sends RESUME<seat><token> instead of IAM and, if the
+// seat is still free, gets STATE<deal type><first seat><cards left> (only
+// if tricks have been taken, else DEAL) and the last TAKEN instead of DEAL
+// and all of them.
+constexpr size_t TOKEN_DIGITS = 16;
+// the longest first message of a client, RESUME
+constexpr size_t HELLO_SIZE = 6 + 1 + TOKEN_DIGITS + 2;
+
+// A parsed message. Nothing is allocated: cards are stored in place and
+// texts (numbers as sent, points) point into the parsed string.
+struct Message {
+    int type = INCORRECT;
+    // deal type (DEAL, STATE) or trick number (TRICK, WRONG, TAKEN), -1 if not a digit
+    int number = 0;
+    std::string_view number_text;
+    // starting seat (DEAL, STATE), the seat taking the trick (TAKEN) or the
+    // seat of a TOKEN
+    char seat = 0;
+    uint8_t cards_no = 0;
+    std::array<Card, 13> cards{};
+    // seats listed in BUSY, SCORE and TOTAL
+    uint8_t seats_no = 0;
+    std::array<char, 4> seats{};
+    // points in SCORE and TOTAL, digits as sent (may be longer than any int)
+    std::array<std::string_view, 4> points{};
+    uint64_t token = 0; // TOKEN
+};
+
+// Single-pass parsers. They accept exactly the messages the protocol
+// regexes used to accept, with one exception: "1" followed by a suit was
+// matched as a card by CARD_REGEX but could never become a Card, so such
+// messages are rejected here. On failure msg.type is INCORRECT.
+bool parse_message(std::string_view s, Message &msg);
+bool parse_TRICK(std::string_view s, Message &msg);
+bool parse_IAM(std::string_view s, char &seat);
+bool parse_RESUME(std::string_view s, char &seat, uint64_t &token);
+// Reads a card at s[i], returns its length (0 if there's no card there).
+size_t parse_card(std::string_view s, size_t i, Card &card) noexcept;
+
+#endif //PROTOCOL_H
@@ -0,0 +1,402 @@
+// Replays a server log ("[sender,receiver,time] message" lines) and checks
+// what the server said against a fresh simulation of every connection's
+// deals: TAKEN and SCORE must be exactly what the rules engine produces from the
+// cards played, the player's own cards must come from its hand and follow
+// suit, and TOTAL must add the deal's SCORE to the previous total. A deal
+// resumed with STATE lacks its first tricks, so it's followed, not checked.
+// The log is mapped a window at a time, so any size streams through in
+// constant memory (plus the state of the connections in it).
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "deals.h"
+#include "engine.h"
+#include "err.h"
+#include "protocol.h"
+
+namespace {
+    // The log's lines, read through a sliding memory mapping.
+    class MappedLog {
+    private:
+        static constexpr size_t WINDOW = size_t{64} << 20;
+        const int fd;
+        size_t size = 0;
+        const char *window = nullptr;
+        size_t window_offset = 0; // in the file
+        size_t window_size = 0;
+        size_t next_line = 0;     // offset in the file
+
+        void unmap() noexcept {
+            if (window != nullptr)
+                munmap(const_cast<char *>(window), window_size);
+            window = nullptr;
+        }
+
+        // maps WINDOW bytes starting at (the page holding) offset
+        void map(size_t offset) {
+            unmap();
+            const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            window_offset = offset / page * page;
+            window_size = std::min(WINDOW, size - window_offset);
+            void *data = mmap(nullptr, window_size, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(window_offset));
+            if (data == MAP_FAILED)
+                syserr("mmap");
+            madvise(data, window_size, MADV_SEQUENTIAL);
+            window = static_cast<const char *>(data);
+        }
+
+        [[nodiscard]] std::string_view rest() const noexcept {
+            return {window + (next_line - window_offset), window_offset + window_size - next_line};
+        }
+    public:
+        explicit MappedLog(const std::string &filename) : fd(open(filename.c_str(), O_RDONLY)) {
+            if (fd == -1)
+                throw std::runtime_error(filename + ": " + strerror(errno));
+            struct stat st{};
+            if (fstat(fd, &st) == -1) {
+                close(fd);
+                throw std::runtime_error(filename + ": " + strerror(errno));
+            }
+            size = static_cast<size_t>(st.st_size);
+        }
+        ~MappedLog() {
+            unmap();
+            close(fd);
+        }
+        MappedLog(const MappedLog &) = delete;
+        MappedLog &operator=(const MappedLog &) = delete;
+
+        // the next line with its '\n' (unless it's the last one), valid until
+        // the next call; false at the end of the log
+        bool next(std::string_view &line) {
+            if (next_line >= size)
+                return false;
+            if (window == nullptr || next_line >= window_offset + window_size)
+                map(next_line);
+            size_t end = rest().find('\n');
+            if (end == std::string_view::npos && window_offset + window_size < size) {
+                map(next_line); // the line crosses the window's end
+                end = rest().find('\n');
+                if (end == std::string_view::npos && window_offset + window_size < size)
+                    throw std::runtime_error("line " + std::to_string(next_line) + " is too long");
+            }
+            line = rest().substr(0, end == std::string_view::npos ? std::string_view::npos : end + 1);
+            next_line += line.size();
+            return true;
+        }
+
+        [[nodiscard]] size_t get_size() const noexcept {
+            return size;
+        }
+    };
+
+    struct Hash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const noexcept {
+            return std::hash<std::string_view>()(s);
+        }
+    };
+    template <class V>
+    using Map = std::unordered_map<std::string, V, Hash, std::equal_to<>>;
+
+    using Points = std::array<int64_t, 4>;
+
+    // SCORE or TOTAL points in N, E, S, W order; false if a seat repeats or a number is too long
+    bool get_points(const Message &msg, Points &points) {
+        std::array<bool, 4> seen{};
+        for (int i = 0; i < msg.seats_no; i++) {
+            int pos = get_index_from_seat(msg.seats[i]);
+            auto text = msg.points[i];
+            if (seen[pos] || std::from_chars(text.data(), text.data() + text.size(), points[pos]).ec != std::errc())
+                return false;
+            seen[pos] = true;
+        }
+        return true;
+    }
+
+    struct PointsHash {
+        size_t operator()(const Points &p) const noexcept {
+            size_t ans = 0;
+            for (int64_t x: p)
+                ans = ans * 1'000'003 + std::hash<int64_t>()(x);
+            return ans;
+        }
+    };
+
+    // What the simulation knows of a single connection.
+    struct Connection {
+        std::string name; // the client's endpoint
+        int pos = -1;     // of the seat, after IAM
+        bool in_deal = false;
+        bool resumed = false; // got STATE, the deal can't be checked until its TOTAL
+        Engine game;
+        Hand hand;            // what's left of the player's cards
+        uint64_t played = 0;  // cards of the deal's tricks so far
+        int trick = 1;        // the next TAKEN expected
+        std::array<Card, 4> asked{}; // cards in the last TRICK from the server
+        size_t asked_no = 0;
+        int asked_trick = 0;
+        bool scored = false;  // SCORE of the deal has come
+        Points score{};
+        bool has_total = false;
+        Points total{};
+    };
+
+    class Replay {
+    private:
+        std::unordered_set<std::string, Hash, std::equal_to<>> servers;
+        Map<std::unique_ptr<Connection>> connections;
+        // every TOTAL sent so far: a connection's first one must follow one of them
+        std::unordered_set<Points, PointsHash> totals{Points{}};
+        size_t reports_left;
+    public:
+        size_t lines = 0;
+        size_t messages = 0;
+        size_t skipped = 0; // lines that aren't a message of a known connection
+        size_t deals = 0;   // verified up to SCORE
+        size_t mismatches = 0;
+
+        explicit Replay(size_t max_reports) : reports_left(max_reports) {}
+
+        void report(const Connection &c, const std::string &what) {
+            mismatches++;
+            if (reports_left == 0)
+                return;
+            reports_left--;
+            std::cout << "line " << lines << ", " << c.name << ": " << what << '\n';
+        }
+
+        void line(std::string_view s) {
+            lines++;
+            // [sender,receiver,time] message
+            size_t first = s.find(','), second = s.find(',', first + 1), end = s.find("] ");
+            if (!s.starts_with('[') || end == std::string_view::npos || second > end) {
+                skipped++;
+                return;
+            }
+            std::string_view sender = s.substr(1, first - 1), receiver = s.substr(first + 1, second - first - 1);
+            std::string_view text = s.substr(end + 2);
+            if (servers.contains(receiver))
+                from_client(sender, text);
+            else if (servers.contains(sender))
+                from_server(receiver, text);
+            else if (is_hello(text)) { // the first connection to a new server address
+                servers.emplace(receiver);
+                from_client(sender, text);
+            }
+            else
+                skipped++;
+        }
+
+        static bool is_hello(std::string_view text) {
+            char seat;
+            uint64_t token;
+            return parse_IAM(text, seat) || parse_RESUME(text, seat, token);
+        }
+
+        void from_client(std::string_view client, std::string_view text) {
+            char seat;
+            uint64_t token;
+            if (!parse_IAM(text, seat) && !parse_RESUME(text, seat, token)) {
+                messages++; // TRICKs are checked once they are taken
+                return;
+            }
+            messages++;
+            auto c = std::make_unique<Connection>();
+            c->name = client;
+            c->pos = get_index_from_seat(seat);
+            connections.insert_or_assign(std::string(client), std::move(c)); // the port may be reused
+        }
+
+        void from_server(std::string_view client, std::string_view text) {
+            auto it = connections.find(client);
+            if (it == connections.end()) {
+                skipped++;
+                return;
+            }
+            messages++;
+            Connection &c = *it->second;
+            Message msg;
+            // the parser takes a single digit after WRONG (as the old regex did), WRONG10-13 are fine too
+            if (!parse_message(text, msg) && !text.starts_with("WRONG")) {
+                report(c, "invalid message " + std::string(text.substr(0, text.find('\r'))));
+                return;
+            }
+            if (c.resumed && msg.type != DEAL && msg.type != TOTAL)
+                return;
+            switch (msg.type) {
+                case BUSY:
+                    connections.erase(it);
+                    break;
+                case DEAL:
+                    deal(c, msg);
+                    break;
+                case TRICK:
+                    asked(c, msg);
+                    break;
+                case TAKEN:
+                    taken(c, msg, text);
+                    break;
+                case SCORE:
+                    score(c, text);
+                    break;
+                case TOTAL:
+                    total(c, msg);
+                    break;
+                case STATE:
+                    c.resumed = true;
+                    c.in_deal = false;
+                    break;
+                default: // WRONG, TOKEN
+                    break;
+            }
+        }
+
+        void deal(Connection &c, const Message &msg) {
+            Deal d{.type = static_cast<uint8_t>(msg.number), .first = msg.seat, .hands = {}};
+            for (int i = 0; i < 13; i++)
+                d.hands[c.pos].add(msg.cards[i]);
+            c.game.start_deal(d);
+            c.hand = d.hands[c.pos];
+            c.in_deal = true;
+            c.resumed = false;
+            c.played = 0;
+            c.trick = 1;
+            c.asked_trick = 0;
+            c.scored = false;
+        }
+
+        void asked(Connection &c, const Message &msg) {
+            if (!c.in_deal || msg.number != c.trick) {
+                report(c, "TRICK" + std::to_string(msg.number) + " while trick " + std::to_string(c.trick) + " is on");
+                return;
+            }
+            // the cards of the players before us
+            size_t expected = static_cast<size_t>((c.pos - c.game.get_pos() + 4) % 4);
+            if (msg.cards_no != expected)
+                report(c, "TRICK with " + std::to_string(msg.cards_no) + " cards, expected " +
+                          std::to_string(expected));
+            std::copy_n(msg.cards.begin(), msg.cards_no, c.asked.begin());
+            c.asked_no = msg.cards_no;
+            c.asked_trick = msg.number;
+        }
+
+        void taken(Connection &c, const Message &msg, std::string_view text) {
+            if (!c.in_deal || c.game.is_deal_over() || msg.number != c.trick) {
+                report(c, "TAKEN" + std::to_string(msg.number) + " while trick " + std::to_string(c.trick) + " is on");
+                return;
+            }
+            const int leader = c.game.get_pos();
+            if (c.asked_trick == msg.number && !std::equal(c.asked.begin(), c.asked.begin() + c.asked_no, msg.cards.begin()))
+                report(c, "TAKEN" + std::to_string(msg.number) + " differs from the cards sent in TRICK");
+            for (int i = 0; i < 4; i++) {
+                const Card &card = msg.cards[i];
+                const uint64_t bit = uint64_t{1} << card.get_code();
+                if (c.played & bit)
+                    report(c, "card " + std::string(card.text()) + " played twice in the deal");
+                c.played |= bit;
+                if ((leader + i) % 4 == c.pos) {
+                    if (!c.hand.remove(card))
+                        report(c, "card " + std::string(card.text()) + " isn't in the player's hand");
+                    else if (incorrect_color(c.hand, {msg.cards.data(), static_cast<size_t>(i)}, card))
+                        report(c, "card " + std::string(card.text()) + " doesn't follow suit");
+                }
+                c.game.play(card);
+            }
+            Frame expected = c.game.get_TAKEN(msg.number);
+            if (expected.view() != text)
+                report(c, "got " + std::string(text.substr(0, text.find('\r'))) + ", expected " +
+                          std::string(expected.view().substr(0, expected.size() - 2)));
+            c.trick++;
+        }
+
+        void score(Connection &c, std::string_view text) {
+            if (!c.in_deal || !c.game.is_deal_over()) {
+                report(c, "SCORE before the deal is over");
+                c.in_deal = false;
+                return;
+            }
+            Frame expected = c.game.get_SCORE();
+            if (expected.view() != text)
+                report(c, "got " + std::string(text.substr(0, text.find('\r'))) + ", expected " +
+                          std::string(expected.view().substr(0, expected.size() - 2)));
+            c.in_deal = false;
+            // TOTAL is checked against the points the server should have sent
+            Message simulated;
+            c.scored = parse_message(expected.view(), simulated) && get_points(simulated, c.score);
+            deals++;
+        }
+
+        void total(Connection &c, const Message &msg) {
+            Points total{};
+            if (c.resumed && get_points(msg, total)) { // nothing to check it against
+                c.resumed = false;
+                totals.insert(total);
+                c.total = total;
+                c.has_total = true;
+                return;
+            }
+            if (!c.scored || !get_points(msg, total)) {
+                report(c, "TOTAL without a SCORE before it");
+                c.scored = false;
+                return;
+            }
+            Points before;
+            for (int i = 0; i < 4; i++)
+                before[i] = total[i] - c.score[i];
+            if (c.has_total ? before != c.total : !totals.contains(before))
+                report(c, "TOTAL doesn't add up with SCORE");
+            totals.insert(total);
+            c.total = total;
+            c.has_total = true;
+            c.scored = false;
+        }
+    };
+
+    [[noreturn]] void usage() {
+        fatal("usage: kierki-replay [-r <max reported mismatches, default: 20>] <log file>");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    size_t max_reports = 20;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        if (opt != 'r' || std::stoi(optarg) < 0)
+            usage();
+        max_reports = std::stoul(optarg);
+    }
+    if (optind + 1 != argc)
+        usage();
+    auto start = std::chrono::steady_clock::now();
+    Replay replay(max_reports);
+    size_t size;
+    try {
+        MappedLog log(argv[optind]);
+        size = log.get_size();
+        std::string_view line;
+        while (log.next(line))
+            replay.line(line);
+    }
+    catch (const std::runtime_error &e) {
+        fatal("%s", e.what());
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << replay.lines << " lines (" << static_cast<double>(size) / 1e6 / seconds << " MB/s), "
+              << replay.messages << " messages, " << replay.skipped << " skipped, "
+              << replay.deals << " deals checked, " << replay.mismatches << " mismatches\n";
+    return replay.mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <array>
+#include <cstdint>
+
+#include "card.h"
+
+// Scoring shared by the server's game state and the client's strategies.
+
+// points for taking a card, by deal type (1-7) and card code
+inline constexpr auto CARD_POINTS = [] {
+    std::array<std::array<uint8_t, 64>, 8> ans{};
+    for (int deal = 1; deal <= 7; deal++) {
+        for (int suit = 0; suit < 4; suit++) {
+            for (int value = 0; value < 13; value++) {
+                const Card c(value, suit);
+                const Value v = c.get_value();
+                int points = 0;
+                if ((deal == 2 || deal == 7) && c.get_suit() == Suit::H)
+                    points++;
+                if ((deal == 3 || deal == 7) && v == Value::Q)
+                    points += 5;
+                if ((deal == 4 || deal == 7) && (v == Value::J || v == Value::K))
+                    points += 2;
+                if ((deal == 5 || deal == 7) && v == Value::K && c.get_suit() == Suit::H)
+                    points += 18;
+                ans[deal][c.get_code()] = static_cast<uint8_t>(points);
+            }
+        }
+    }
+    return ans;
+}();
+
+// points for taking a trick itself, by deal type and trick (0-12)
+inline constexpr auto TRICK_POINTS = [] {
+    std::array<std::array<uint8_t, 13>, 8> ans{};
+    for (int deal = 1; deal <= 7; deal++) {
+        for (int trick = 0; trick < 13; trick++) {
+            if (deal == 1 || deal == 7)
+                ans[deal][trick]++; // point for each trick
+            if (deal >= 6 && (trick == 6 || trick == 12))
+                ans[deal][trick] += 10; // points for 7th and 13th trick
+        }
+    }
+    return ans;
+}();
+
+// all points of a deal type, by deal type
+inline constexpr auto DEAL_POINTS = [] {
+    std::array<int, 8> ans{};
+    for (int deal = 1; deal <= 7; deal++) {
+        for (int code = 0; code < 64; code++)
+            ans[deal] += CARD_POINTS[deal][code];
+        for (int trick = 0; trick < 13; trick++)
+            ans[deal] += TRICK_POINTS[deal][trick];
+    }
+    return ans;
+}();
+
+// position (from the one who led) of the card taking a full trick
+constexpr int trick_winner(const Card *trick) noexcept {
+    int ans = 0;
+    for (int i = 1; i < 4; i++)
+        if (trick[ans] < trick[i])
+            ans = i;
+    return ans;
+}
+
+#endif //RULES_H
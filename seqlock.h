@@ -0,0 +1,49 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// A value published by a single writer and copied by any number of
+// readers. Readers never block the writer: they retry if it stored in the
+// meantime. The value is kept in atomic words, so a torn copy is never
+// used and the whole thing is free of data races (ThreadSanitizer agrees).
+template <class T>
+class SeqLock {
+    static_assert(std::is_trivially_copyable_v<T>);
+private:
+    static constexpr size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    std::atomic<uint64_t> sequence{0}; // odd while a store is in progress
+    std::array<std::atomic<uint64_t>, WORDS> words{};
+public:
+    // only one thread may store at a time
+    void store(const T &value) noexcept {
+        std::array<uint64_t, WORDS> raw{};
+        std::memcpy(raw.data(), &value, sizeof(T));
+        const uint64_t seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        // a reader that sees any of the new words sees the odd sequence too
+        for (size_t i = 0; i < WORDS; i++)
+            words[i].store(raw[i], std::memory_order_release);
+        sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    [[nodiscard]] T load() const noexcept {
+        std::array<uint64_t, WORDS> raw;
+        uint64_t before, after;
+        do {
+            before = sequence.load(std::memory_order_acquire);
+            for (size_t i = 0; i < WORDS; i++)
+                raw[i] = words[i].load(std::memory_order_acquire);
+            after = sequence.load(std::memory_order_relaxed);
+        } while (before != after || (before & 1) != 0);
+        T ans;
+        std::memcpy(static_cast<void *>(&ans), raw.data(), sizeof(T));
+        return ans;
+    }
+};
+
+#endif //SEQLOCK_H
@@ -5,11 +5,30 @@
 #include <atomic>
 #include <bitset>
 #include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <netinet/in.h>
 #include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "card.h"
 #include "common.h"
+#include "deals.h"
+#include "engine.h"
+#include "frame.h"
+#include "metrics.h"
+#include "seqlock.h"
+#include "trace.h"
 
 class ActiveMap {
 private:
@@ -36,10 +55,9 @@ public:
         return ans;
     }
 
-    void disconnect(const int &pos, const int &event_fd) {
+    void leave(const int &pos) {
         std::unique_lock<std::mutex> lock(mutex_four);
         active_map.reset(pos);
-        increment_event_fd(event_fd);
     }
 
     void end_game() noexcept {
@@ -67,112 +85,390 @@ public:
     }
 };
 
-class GameState {
+// A deal with a single writer at a time: the game master starts deals
+// (once no player reads the previous one) and the player holding the
+// turn plays, the mailboxes hand the ownership over. Every change is
+// published, and other threads read only snapshot(): they never block the
+// writer nor see half of a play. The reactor, being the only thread of
+// its tables, may use the getters directly.
+class GameState : public Engine {
 private:
-    std::array<std::vector<Card>, 4> hands;
-    int current_deal;
-    char first_player;
-    char player;
-    std::array<std::vector<Card>, 13> tricks;
-    std::array<char, 13> taken;
-    std::unordered_map<char, int> points_deal;
-    std::unordered_map<char, int> points_total = {{'N', 0}, {'E', 0}, {'S', 0}, {'W', 0}};
-    int current_trick;
-    static int get_card_points(int deal, Card c) {
-        int ans = 0;
-        if ((deal == 2 || deal == 7) && c.get_suit() == Suit::H)
-            ans++;
-        if ((deal == 3 || deal == 7) && c.to_string()[0] == 'Q')
-            ans += 5;
-        if ((deal == 4 || deal == 7) && (c.to_string()[0] == 'J' || c.to_string()[0] == 'K'))
-            ans += 2;
-        if ((deal == 5 || deal == 7) && c.to_string() == "KH")
-            ans += 18;
-        return ans;
+    SeqLock<DealState> published;
+
+    void publish() noexcept {
+        published.store(*this);
     }
 public:
-    void start_game(const int &pos, const std::vector<Card> &hand, int deal, char first) {
-        hands[pos] = hand;
-        current_deal = deal;
-        first_player = player = first;
-        current_trick = 0;
-        points_deal = {{'N', 0}, {'E', 0}, {'S', 0}, {'W', 0}};
-        tricks = std::array<std::vector<Card>, 13>();
-        taken = std::array<char, 13>();
+    GameState() {
+        publish();
     }
 
-    [[nodiscard]] std::vector<Card> get_hand(const int &pos) const noexcept {
-        return hands[pos];
+    void start_deal(const Deal &deal) noexcept {
+        Engine::start_deal(deal);
+        publish();
     }
 
-    [[nodiscard]] char get_first() const noexcept {
-        return first_player;
+    void play(const Card &c) noexcept {
+        Engine::play(c);
+        publish();
     }
 
-    [[nodiscard]] int get_pos() const noexcept {
-        return get_index_from_seat(player);
+    [[nodiscard]] DealState snapshot() const noexcept {
+        return published.load();
     }
+};
 
-    [[nodiscard]] int get_deal() const noexcept {
-        return current_deal;
+// What a seat is told by the game master or by the player before it in
+// a trick. It holds the state to act on rather than a queue of events, so
+// whoever takes the seat next finds it as it is and nothing gets re-sent.
+// Posting never blocks and touches the eventfd only if the seat's thread
+// is blocked waiting for mail.
+class Mailbox {
+public:
+    struct Mail {
+        uint32_t deal = 0;  // number of the deal in play, 0 before the first one
+        uint8_t turn = 0;   // trick the seat has to play in, 0 if none
+        uint8_t taken = 0;  // tricks of the deal already taken
+        bool paused = true; // the table waits for players (or a deal)
+        bool over = false;  // no more deals
+        bool operator==(const Mail &) const = default;
+    };
+private:
+    static_assert(std::atomic<Mail>::is_always_lock_free);
+    std::atomic<Mail> mail{Mail{}};
+    std::atomic<bool> blocked{false};
+    const int wake_fd;
+public:
+    // deal the seat's player is sending (0 if none), so the game master
+    // doesn't start the next one under it
+    std::atomic<uint32_t> reading{0};
+
+    Mailbox() : wake_fd(eventfd(0, EFD_NONBLOCK)) {
+        if (wake_fd == -1)
+            syserr("couldn't create eventfd");
     }
+    ~Mailbox() {
+        close(wake_fd);
+    }
+    Mailbox(const Mailbox &) = delete;
+    Mailbox &operator=(const Mailbox &) = delete;
 
-    [[nodiscard]] int get_trick_no() const noexcept {
-        return current_trick + 1;
+    [[nodiscard]] Mail read() const noexcept {
+        return mail.load();
     }
 
-    [[nodiscard]] const std::vector<Card> &get_trick(int trick) const noexcept {
-        return tricks[trick - 1];
+    template <class F>
+    void post(F change) {
+        TRACE_SPAN("Mailbox::post");
+        Mail old = mail.load(), updated;
+        do {
+            updated = old;
+            change(updated);
+        } while (!mail.compare_exchange_weak(old, updated));
+        if (blocked.load())
+            increment_event_fd(wake_fd);
     }
 
-    void play(const Card &c) {
-        tricks[current_trick].push_back(c);
-        if (tricks[current_trick].size() == 4) {
-            Card highest = tricks[current_trick][0];
-            int start_pos = get_pos();
-            for (int i = 1; i < 4; i++) {
-                if (highest < tricks[current_trick][i]) {
-                    highest = tricks[current_trick][i];
-                    player = get_seat_from_index((start_pos + i) % 4);
-                }
-            }
-            taken[current_trick] = player;
-            for (const auto &card: tricks[current_trick]) {
-                points_deal[player] += get_card_points(current_deal, card);
+    // polls client together with the mailbox, returns like poll; mail other
+    // than seen (the one the caller decided to wait on) ends the wait
+    int wait(const Mail &seen, pollfd &client, int timeout) {
+        TRACE_SPAN("Mailbox::wait");
+        blocked.store(true);
+        if (read() != seen) {
+            blocked.store(false);
+            return 1;
+        }
+        pollfd fds[2] = {client, {.fd = wake_fd, .events = POLLIN, .revents = 0}};
+        int ans = poll(fds, 2, timeout);
+        blocked.store(false);
+        if (fds[1].revents & POLLIN) {
+            uint64_t posts;
+            ::read(wake_fd, &posts, sizeof posts);
+        }
+        client.revents = fds[0].revents;
+        return ans;
+    }
+};
+
+// Everything a single game needs: seats, state, deal file and the channels
+// between its game master and player threads.
+class Table {
+public:
+    ActiveMap active;
+    GameState game;
+    std::array<Mailbox, 4> seats;
+    // bumped when: (a) player leaves (b) trick is over (c) player is done
+    // with a deal; the game master waits on it
+    std::atomic<uint32_t> events{0};
+    std::atomic<int> tricks_done{0}; // in the current deal
+    // frames every seat gets, encoded once by the game master before it
+    // posts the trick taken (or the deal over)
+    std::array<FrameRef, 13> taken;
+    FrameRef score;
+    FrameRef total;
+    const std::vector<Deal> &deals;
+    size_t next_deal = 0;
+    Metrics &metrics;
+    std::thread master;
+
+    Table(const std::vector<Deal> &deals, Metrics &metrics) : deals(deals), metrics(metrics) {}
+    Table(const Table &) = delete;
+    Table &operator=(const Table &) = delete;
+
+    void notify_master() {
+        events.fetch_add(1);
+        events.notify_one();
+    }
+
+    // change(pos, mail) for every seat
+    template <class F>
+    void post_all(F change) {
+        for (int pos = 0; pos < 4; pos++)
+            seats[pos].post([&change, pos](Mailbox::Mail &mail) { change(pos, mail); });
+    }
+};
+
+// Places incoming players on tables. Tables are created lazily (make_table
+// gets the index of the new table), so an idle server costs no more than
+// a single game. Every seat taken gets a new resumption token.
+template <class T>
+class Lobby {
+private:
+    const size_t max_tables;
+    const std::function<std::unique_ptr<T>(size_t)> make_table;
+    std::vector<std::unique_ptr<T>> tables;
+    std::vector<std::array<uint64_t, 4>> tokens; // of the seats, by table
+    std::mutex mutex;
+
+    // tokens let anyone take the seat over, so they must not be predictable
+    T *seat_at(size_t i, char seat, uint64_t &token) {
+        do {
+            if (getrandom(&token, sizeof token, 0) != sizeof token)
+                throw std::runtime_error("getrandom");
+        } while (token == 0);
+        tokens[i][get_index_from_seat(seat)] = token;
+        return tables[i].get();
+    }
+public:
+    Lobby(size_t max_tables, std::function<std::unique_ptr<T>(size_t)> make_table) :
+        max_tables(max_tables), make_table(std::move(make_table)) {}
+
+    // returns a table with a free seat, or nullptr with busy set to
+    // the list of occupied seats of the last table tried. The seat's last
+    // token (if not 0) takes it back at its table, with resumed set. Token
+    // is replaced by the one of the seat taken.
+    T *take_seat(char seat, std::string &busy, uint64_t &token, bool &resumed) {
+        std::unique_lock<std::mutex> lock(mutex);
+        const int pos = get_index_from_seat(seat);
+        resumed = false;
+        for (size_t i = 0; token != 0 && i < tables.size(); i++) {
+            if (tokens[i][pos] == token && tables[i]->active.setActive(seat).empty()) {
+                resumed = true;
+                return seat_at(i, seat, token);
             }
-            if (current_deal == 1 || current_deal == 7)
-                points_deal[player]++; // point for each trick
-            if (current_deal >= 6 && (current_trick == 6 || current_trick == 12))
-                points_deal[player] += 10; // points for 7th and 13th trick
-            current_trick++;
-            if (current_trick == 13) // end of deal
-                for (const auto &[k, v]: points_deal)
-                    points_total[k] += v;
-        }
-    }
-
-    std::string get_TAKEN(int trick) {
-        std::stringstream ss;
-        ss << "TAKEN" << trick << cards_to_string(tricks[trick - 1]) << taken[trick - 1] << "\r\n";
-        return ss.str();
-    }
-
-    std::string get_SCORE() {
-        std::stringstream ss;
-        ss << "SCORE";
-        for (const auto &[k, v]: points_deal)
-            ss << k << v;
-        ss << "\r\n";
-        return ss.str();
-    }
-
-    std::string get_TOTAL() {
-        std::stringstream ss;
-        ss << "TOTAL";
-        for (const auto &[k, v]: points_total)
-            ss << k << v;
-        ss << "\r\n";
-        return ss.str();
+        }
+        for (size_t i = 0; i < tables.size(); i++) {
+            busy = tables[i]->active.setActive(seat);
+            if (busy.empty())
+                return seat_at(i, seat, token);
+        }
+        if (tables.size() == max_tables)
+            return nullptr;
+        tables.emplace_back(make_table(tables.size()));
+        tokens.emplace_back();
+        busy = tables.back()->active.setActive(seat);
+        return seat_at(tables.size() - 1, seat, token);
+    }
+
+    [[nodiscard]] size_t get_max_tables() const noexcept {
+        return max_tables;
+    }
+
+    void for_each(const std::function<void(T &)> &f) {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (auto &table: tables)
+            f(*table);
+    }
+};
+
+// Keeps count of the open connections, up to a cap, and owns the threads
+// serving them: a thread is joined by the reaper as soon as it's done, so
+// churn doesn't pile up finished threads until the end of the game.
+class Supervisor {
+public:
+    // a place among the open connections, given back when destroyed
+    class Slot {
+    private:
+        Supervisor *owner = nullptr;
+        friend class Supervisor;
+        explicit Slot(Supervisor *owner) noexcept : owner(owner) {}
+    public:
+        Slot() = default;
+        Slot(Slot &&other) noexcept : owner(std::exchange(other.owner, nullptr)) {}
+        Slot &operator=(Slot other) noexcept {
+            std::swap(owner, other.owner);
+            return *this;
+        }
+        ~Slot() {
+            if (owner != nullptr)
+                owner->open.fetch_sub(1, std::memory_order_relaxed);
+        }
+        explicit operator bool() const noexcept {
+            return owner != nullptr;
+        }
+    };
+private:
+    const size_t cap;
+    std::atomic<size_t> open{0};
+    std::mutex mutex;
+    std::condition_variable changed;
+    // a finished thread's node moves to finished and is freed once joined,
+    // so nothing is allocated when a thread ends
+    std::list<std::thread> running;
+    std::list<std::thread> finished; // to be joined
+    bool stopping = false;
+    std::thread reaper;
+
+    void reap() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [this] { return !finished.empty() || (stopping && running.empty()); });
+            std::list<std::thread> done;
+            done.splice(done.end(), finished);
+            lock.unlock();
+            for (std::thread &t: done)
+                t.join(); // it has just returned from its function
+            lock.lock();
+            if (stopping && running.empty() && finished.empty())
+                return;
+        }
+    }
+public:
+    // cap - open connections at most, 0 means no limit
+    explicit Supervisor(size_t cap) : cap(cap), reaper(&Supervisor::reap, this) {}
+    ~Supervisor() {
+        join();
+    }
+    Supervisor(const Supervisor &) = delete;
+    Supervisor &operator=(const Supervisor &) = delete;
+
+    // a slot for a new connection, an empty one if the cap is reached
+    [[nodiscard]] Slot admit() noexcept {
+        size_t now = open.fetch_add(1, std::memory_order_relaxed);
+        if (cap != 0 && now >= cap) {
+            open.fetch_sub(1, std::memory_order_relaxed);
+            return {};
+        }
+        return Slot(this);
+    }
+
+    [[nodiscard]] size_t get_open() const noexcept {
+        return open.load(std::memory_order_relaxed);
+    }
+
+    // runs f() on a thread of its own, which holds the slot while running
+    template <class F>
+    void spawn(Slot slot, F f) {
+        std::unique_lock<std::mutex> lock(mutex);
+        // the thread's node is in running: it can't move it before we unlock
+        auto it = running.emplace(running.end());
+        *it = std::thread([this, it, slot = std::move(slot), f = std::move(f)]() mutable {
+            f();
+            slot = Slot();
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.splice(finished.end(), running, it);
+            changed.notify_one();
+        });
+    }
+
+    // waits for every thread spawned, none may be spawned after
+    void join() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (stopping)
+                return;
+            stopping = true;
+            changed.notify_one();
+        }
+        reaper.join();
+    }
+};
+
+// Counts the connections of every address that haven't sent their first
+// message yet, so a single host can't hold many sockets idle.
+class HalfOpen {
+private:
+    using Address = std::array<unsigned char, 16>; // IPv4 as mapped IPv6
+    struct Hash {
+        size_t operator()(const Address &a) const noexcept {
+            uint64_t high, low;
+            std::memcpy(&high, a.data(), sizeof high);
+            std::memcpy(&low, a.data() + sizeof high, sizeof low);
+            return std::hash<uint64_t>()(high * 0x9e3779b97f4a7c15ULL ^ low);
+        }
+    };
+public:
+    // a half-open connection, counted until destroyed
+    class Pass {
+    private:
+        HalfOpen *owner = nullptr;
+        Address address{};
+        friend class HalfOpen;
+        Pass(HalfOpen *owner, const Address &address) noexcept : owner(owner), address(address) {}
+    public:
+        Pass() = default;
+        Pass(Pass &&other) noexcept : owner(std::exchange(other.owner, nullptr)), address(other.address) {}
+        Pass &operator=(Pass other) noexcept {
+            std::swap(owner, other.owner);
+            std::swap(address, other.address);
+            return *this;
+        }
+        ~Pass() {
+            if (owner != nullptr)
+                owner->leave(address);
+        }
+        explicit operator bool() const noexcept {
+            return owner != nullptr;
+        }
+    };
+private:
+    const size_t limit;
+    std::mutex mutex;
+    std::unordered_map<Address, size_t, Hash> counts; // only the addresses with some
+
+    void leave(const Address &address) noexcept {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = counts.find(address);
+        if (--it->second == 0)
+            counts.erase(it);
+    }
+public:
+    // limit - per address, 0 means no limit
+    explicit HalfOpen(size_t limit) : limit(limit) {}
+    HalfOpen(const HalfOpen &) = delete;
+    HalfOpen &operator=(const HalfOpen &) = delete;
+
+    // false if the client's address has too many half-open connections
+    // already, else pass counts the new one (unless there's no limit)
+    [[nodiscard]] bool enter(const sockaddr_storage &client, Pass &pass) {
+        if (limit == 0)
+            return true;
+        Address address{};
+        if (client.ss_family == AF_INET6)
+            std::memcpy(address.data(), &reinterpret_cast<const sockaddr_in6 &>(client).sin6_addr, address.size());
+        else { // written as ::ffff:a.b.c.d
+            address[10] = address[11] = 0xff;
+            std::memcpy(address.data() + 12, &reinterpret_cast<const sockaddr_in &>(client).sin_addr, 4);
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            size_t &count = counts[address];
+            if (count == limit)
+                return false;
+            count++;
+        }
+        pass = Pass(this, address);
+        return true;
     }
 };
 
@@ -0,0 +1,238 @@
+#include "server_main.h"
+
+#include <functional>
+#include <iostream>
+#include <poll.h>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+
+#include "server_reactor.h"
+#include "server_threads.h"
+
+int socket_init(const int &port, int backlog, bool reuse_port) {
+    int socket_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0)
+        syserr("cannot create a socket");
+    int on = 1, off = 0;
+    // IPv4 clients come as mapped addresses, whatever the system's default
+    if (setsockopt(socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off) < 0)
+        syserr("setsockopt IPV6_V6ONLY");
+    if (reuse_port && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0)
+        syserr("setsockopt SO_REUSEPORT");
+    sockaddr_in6 server_address {};
+    server_address.sin6_family = AF_INET6;
+    server_address.sin6_addr = in6addr_any; // Listening on all interfaces.
+    server_address.sin6_port = htons(port);
+
+    if (bind(socket_fd, (struct sockaddr *) &server_address, (socklen_t) sizeof server_address) < 0)
+        syserr("bind");
+
+    // Switch the socket to listening.
+    if (listen(socket_fd, backlog) < 0)
+        syserr("listen");
+    return socket_fd;
+}
+
+int get_port(const int &socket_fd) {
+    // Find out what port the server is actually listening on.
+    sockaddr_in6 server_address {};
+    auto lenght = (socklen_t) sizeof server_address;
+    if (getsockname(socket_fd, (struct sockaddr *) &server_address, &lenght) < 0)
+        syserr("getsockname");
+    return ntohs(server_address.sin6_port);
+}
+
+namespace {
+    // (client_fd, client_address, server_address)
+    using Handler = std::function<void(int, const sockaddr_storage &, const sockaddr_storage &)>;
+
+    // A thread accepting on its own listening socket. Sockets bound to a
+    // port with SO_REUSEPORT get its connections spread by the kernel, so
+    // acceptors don't contend for a single queue. Each client is handed
+    // straight to handle, from this thread.
+    class Acceptor {
+    private:
+        const int socket_fd;
+        const int stop_fd;
+        const Handler &handle;
+        std::thread thread;
+
+        // takes every pending connection, false if told to stop
+        void accept_all() {
+            sockaddr_storage client_address{}, server_address{};
+            while (true) {
+                auto addr_size = static_cast<socklen_t>(sizeof client_address);
+                int client_fd = accept4(socket_fd, (sockaddr *) &client_address, &addr_size,
+                                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (client_fd == -1) {
+                    // a client may be gone before it's accepted, that's no reason to wait
+                    if (errno == EINTR || errno == ECONNABORTED)
+                        continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        error("accept4");
+                    return;
+                }
+                addr_size = static_cast<socklen_t>(sizeof server_address);
+                if (getsockname(client_fd, (sockaddr *) &server_address, &addr_size)) {
+                    error("getsockname");
+                    close(client_fd);
+                    continue;
+                }
+                // bursts are gathered before writing, Nagle would only hold them back
+                int one = 1;
+                setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+                handle(client_fd, client_address, server_address);
+            }
+        }
+
+        void run() {
+            pollfd fds[2];
+            fds[0] = {.fd = socket_fd, .events = POLLIN, .revents = 0};
+            fds[1] = {.fd = stop_fd, .events = POLLIN, .revents = 0};
+            while (true) {
+                if (poll(fds, 2, -1) == -1) {
+                    if (errno != EINTR)
+                        syserr("poll");
+                    continue;
+                }
+                if (fds[1].revents & POLLIN)
+                    return;
+                if (fds[0].revents & POLLIN)
+                    accept_all();
+            }
+        }
+    public:
+        // the clients' sockets are non-blocking
+        Acceptor(int socket_fd, const Handler &handle) :
+            socket_fd(socket_fd), stop_fd(eventfd(0, EFD_CLOEXEC)), handle(handle) {
+            if (stop_fd == -1)
+                syserr("couldn't create eventfd");
+            thread = std::thread(&Acceptor::run, this);
+        }
+        ~Acceptor() {
+            stop();
+            close(stop_fd);
+            close(socket_fd);
+        }
+        Acceptor(const Acceptor &) = delete;
+        Acceptor &operator=(const Acceptor &) = delete;
+
+        // no client is handled once it returns
+        void stop() {
+            if (!thread.joinable())
+                return;
+            increment_event_fd(stop_fd);
+            thread.join();
+        }
+    };
+}
+
+void run_server(const server_config &config, const std::vector<Deal> &deals, int socket_fd) {
+    int game_over_fd = eventfd(0, 0);
+    if (game_over_fd == -1)
+        syserr("couldn't create eventfd");
+    Metrics metrics;
+    int metrics_fd = -1;
+    if (config.metrics_port >= 0) {
+        metrics_fd = socket_init(config.metrics_port);
+        std::cerr << "metrics on port " << get_port(metrics_fd) << '\n';
+    }
+    pollfd fds[2];
+    fds[0] = {.fd = game_over_fd, .events = POLLIN, .revents = 0};
+    fds[1] = {.fd = metrics_fd, .events = POLLIN, .revents = 0}; // ignored by poll if -1
+
+    Logger logger(config.log_file);
+    // broadcasts stay referenced by the logs until written, some tens of ms;
+    // this covers that at full speed (kierki-bench), so the pool doesn't grow mid-game
+    SharedFrame::reserve(SharedFrame::BLOCK * (16 + config.tables / 4));
+    Lobby<Table> lobby(config.tables, [&deals, &metrics, game_over_fd](size_t) {
+        return open_table(deals, game_over_fd, metrics);
+    });
+    // these two outlive the connections, in either mode
+    Supervisor supervisor(config.max_connections);
+    HalfOpen half_open(config.half_open);
+    std::unique_ptr<ReactorPool> reactors;
+    if (config.loops > 0)
+        reactors = std::make_unique<ReactorPool>(config.loops, deals, config.tables,
+                                                 config.timeout, game_over_fd, logger, metrics, config.cork);
+    // thread per player: the first message is awaited without a thread
+    std::unique_ptr<Handshaker> handshaker;
+    if (!reactors)
+        handshaker = std::make_unique<Handshaker>(config.timeout, [&](std::unique_ptr<SendData> send_data,
+                                                                      Supervisor::Slot slot) {
+            const int client_fd = send_data->get_fd();
+            try {
+                supervisor.spawn(std::move(slot), [&, send_data = std::move(send_data)] {
+                    handle_player(*send_data, config.timeout, metrics, lobby);
+                });
+            }
+            catch (const std::system_error &e) {
+                error("cannot start a thread: %s", e.what());
+                close(client_fd);
+            }
+        });
+    Handler handle = [&](int client_fd, const sockaddr_storage &client_address, const sockaddr_storage &server_address) {
+        Supervisor::Slot slot = supervisor.admit();
+        HalfOpen::Pass pass;
+        if (!slot || !half_open.enter(client_address, pass)) {
+            // no thread, no state: the client only sees the connection closed
+            count(metrics.rejected);
+            close(client_fd);
+            return;
+        }
+        if (reactors) {
+            reactors->dispatch(client_fd, std::move(slot), std::move(pass), client_address, server_address);
+            return;
+        }
+        auto send_data = std::make_unique<SendData>(client_fd, server_address, client_address, &logger, &metrics);
+        send_data->set_cork(config.cork);
+        handshaker->add(std::move(send_data), std::move(slot), std::move(pass));
+    };
+    std::vector<std::unique_ptr<Acceptor>> acceptors;
+    const int port = get_port(socket_fd);
+    for (size_t i = 0; i < config.acceptors; i++) {
+        int fd = i == 0 ? socket_fd : socket_init(port, config.backlog, true);
+        acceptors.push_back(std::make_unique<Acceptor>(fd, handle));
+    }
+    size_t tables_over = 0;
+
+    do {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno != EINTR)
+                syserr("poll");
+            continue;
+        }
+        if (fds[0].revents & POLLIN) { // a game is over
+            fds[0].revents = 0;
+            uint64_t finished;
+            read(game_over_fd, &finished, sizeof finished);
+            tables_over += finished;
+            if (tables_over == config.tables) { // finish everything
+                acceptors.clear(); // closes the listening sockets
+                close(game_over_fd);
+                if (metrics_fd != -1)
+                    close(metrics_fd);
+                break;
+            }
+        }
+        if (fds[1].revents & POLLIN) { // a scrape of the metrics
+            fds[1].revents = 0;
+            int client_fd = accept4(metrics_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd != -1)
+                serve_metrics(client_fd, metrics);
+        }
+    } while (true);
+    if (reactors)
+        reactors->stop();
+    else
+        handshaker->stop();
+    lobby.for_each([](Table &table) {
+        table.master.join();
+    });
+    supervisor.join();
+    logger.stop();
+}
@@ -0,0 +1,21 @@
+#ifndef SERVER_MAIN_H
+#define SERVER_MAIN_H
+
+#include <vector>
+#include <sys/socket.h>
+
+#include "deals.h"
+#include "parser.h"
+
+// creates a non-blocking listening socket on the port (0 - chosen
+// automatically); with reuse_port more of them may listen on the same port
+int socket_init(const int &port, int backlog = SOMAXCONN, bool reuse_port = false);
+// port the socket is bound to
+int get_port(const int &socket_fd);
+
+// serves the tables on the listening socket (and config.acceptors - 1 more
+// on its port, if it was created with reuse_port) until all of them have
+// played every deal, closes the sockets
+void run_server(const server_config &config, const std::vector<Deal> &deals, int socket_fd);
+
+#endif //SERVER_MAIN_H
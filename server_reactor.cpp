@@ -0,0 +1,602 @@
+#include "server_reactor.h"
+
+#include <algorithm>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "err.h"
+#include "protocol.h"
+#include "server_threads.h"
+#include "trace.h"
+
+// a client that doesn't read its messages is dropped instead of being buffered for
+constexpr size_t MAX_PENDING = 1 << 16;
+constexpr int MAX_EVENTS = 64;
+
+struct Connection {
+    const int fd;
+    Supervisor::Slot slot; // among the open connections, given back with the connection
+    HalfOpen::Pass pass;   // given back with IAM
+    SendData send_data; // its queue holds what's not written yet
+    ReactorTable *table = nullptr;
+    int pos = -1;
+    uint64_t token = 0;     // its resumption token, once seated, 0 if it sent IAM
+    bool resumed = false;   // took the seat back with its previous token
+    Hand hand;
+    bool in_deal = false;   // got DEAL of the current deal
+    bool prompted = false;  // was sent TRICK and hasn't answered correctly yet
+    Metrics::Clock::time_point asked; // when it was prompted
+    bool closing = false;   // close as soon as the queue is sent
+    bool broken = false;    // waits to be closed
+    uint64_t timer = 0;     // generation of the armed timer, 0 if none
+    uint32_t events = 0;    // events registered in epoll
+
+    Connection(int fd, Supervisor::Slot slot, HalfOpen::Pass pass, const sockaddr_storage &server_address,
+               const sockaddr_storage &client_address, Logger &logger, Metrics &metrics) :
+        fd(fd), slot(std::move(slot)), pass(std::move(pass)),
+        send_data(fd, server_address, client_address, &logger, &metrics) {}
+};
+
+// A table played out by a single reactor: the counterpart of the
+// game master and the four player threads.
+class ReactorTable {
+private:
+    const std::vector<Deal> &deals;
+    size_t next_deal = 0;
+    Reactor &loop;
+    Metrics &metrics;
+    const int game_over_fd;
+    std::array<Connection *, 4> seats{};
+    bool dealt = false;   // a deal is loaded and not finished yet
+    bool playing = false; // all four players are there and got the deal
+    bool paused = false;  // stopped playing because someone left
+    bool over = false;
+    Metrics::Clock::time_point deal_start;
+
+    [[nodiscard]] int get_turn() const noexcept {
+        return (game.get_pos() + static_cast<int>(game.get_trick(game.get_trick_no()).size())) % 4;
+    }
+
+    // encodes msg once for all the seats
+    void send_all(const Frame &msg) {
+        FrameRef shared(msg);
+        for (Connection *c: seats)
+            if (c != nullptr)
+                loop.send(*c, shared);
+    }
+
+    void send_TRICK(Connection &c) {
+        int trick_no = game.get_trick_no();
+        loop.send(c, frame_TRICK(trick_no, game.get_trick(trick_no)).view());
+        loop.arm_timer(c);
+    }
+
+    void send_WRONG(Connection &c) {
+        count(metrics.wrong);
+        loop.send(c, frame_WRONG(game.get_trick_no()).view());
+    }
+
+    // sends DEAL and all the tricks taken so far, or just the cards left
+    // and the last trick to a resumed seat
+    void catch_up(Connection &c) {
+        const int trick_no = game.get_trick_no();
+        // a previous player at the seat may have played in the current trick already
+        c.hand = game.get_hand_before(c.pos, trick_no + 1);
+        c.send_data.new_deal(); // unless a slow reader still has frames queued
+        if (c.resumed && trick_no > 1) {
+            loop.send(c, frame_STATE(game.get_deal(), game.get_first(), game.get_hand_before(c.pos, trick_no)).view());
+            loop.send(c, game.get_TAKEN(trick_no - 1).view());
+        }
+        else {
+            loop.send(c, frame_DEAL(game.get_deal(), game.get_first(), game.get_hand(c.pos)).view());
+            for (int i = 1; i < trick_no; i++)
+                loop.send(c, game.get_TAKEN(i).view());
+        }
+        c.in_deal = true;
+    }
+
+    void resume() {
+        if (!dealt) {
+            if (!get_deal(deals, next_deal, game)) {
+                finish();
+                return;
+            }
+            dealt = true;
+            deal_start = Metrics::Clock::now();
+        }
+        if (paused) {
+            paused = false;
+            count(metrics.resumes);
+        }
+        for (Connection *c: seats)
+            if (!c->in_deal)
+                catch_up(*c);
+        playing = true;
+        prompt(*seats[get_turn()]);
+    }
+
+    void prompt(Connection &c) {
+        c.prompted = true;
+        c.asked = Metrics::Clock::now();
+        send_TRICK(c);
+    }
+
+    void end_deal() {
+        metrics.deal_duration.observe(Metrics::Clock::now() - deal_start);
+        send_all(game.get_SCORE());
+        send_all(game.get_TOTAL());
+        dealt = playing = false;
+        for (Connection *c: seats)
+            c->in_deal = false;
+        if (next_deal == deals.size())
+            finish();
+        else
+            resume();
+    }
+
+    void finish() {
+        over = true;
+        playing = false;
+        active.end_game();
+        for (Connection *c: seats)
+            if (c != nullptr)
+                loop.close_after_flush(*c);
+        increment_event_fd(game_over_fd);
+    }
+
+    void play(Connection &c, const Message &msg) {
+        if (msg.cards_no != 1) {
+            loop.disconnect(c);
+            return;
+        }
+        const Card &card = msg.cards[0];
+        int trick_no = game.get_trick_no();
+        if (msg.number != trick_no || incorrect_color(c.hand, game.get_trick(trick_no), card) || !c.hand.remove(card)) {
+            send_WRONG(c);
+            loop.arm_timer(c);
+            return;
+        }
+        c.prompted = false;
+        loop.disarm_timer(c);
+        metrics.move_latency.observe(Metrics::Clock::now() - c.asked);
+        game.play(card);
+        if (game.get_trick(trick_no).size() == 4) {
+            send_all(game.get_TAKEN(trick_no));
+            if (game.is_deal_over()) {
+                end_deal();
+                return;
+            }
+        }
+        prompt(*seats[get_turn()]);
+    }
+
+public:
+    ActiveMap active;
+    GameState game;
+
+    ReactorTable(const std::vector<Deal> &deals, Reactor &loop, Metrics &metrics, int game_over_fd) :
+        deals(deals), loop(loop), metrics(metrics), game_over_fd(game_over_fd) {}
+
+    [[nodiscard]] Reactor &get_loop() const noexcept {
+        return loop;
+    }
+
+    void sit(Connection &c) {
+        if (over) {
+            loop.disconnect(c);
+            return;
+        }
+        seats[c.pos] = &c;
+        if (c.token != 0)
+            loop.send(c, frame_token("TOKEN", get_seat_from_index(c.pos), c.token).view());
+        if (std::ranges::all_of(seats, [](const Connection *s){return s != nullptr;}))
+            resume();
+    }
+
+    void leave(Connection &c) {
+        if (seats[c.pos] != &c)
+            return;
+        seats[c.pos] = nullptr;
+        if (over)
+            return;
+        active.leave(c.pos);
+        if (playing) { // pause the game, the current player will be asked again on resume
+            playing = false;
+            paused = true;
+            count(metrics.pauses);
+            for (Connection *s: seats) {
+                if (s != nullptr) {
+                    s->prompted = false;
+                    loop.disarm_timer(*s);
+                }
+            }
+        }
+    }
+
+    void receive(Connection &c, const std::string &msg, int status) {
+        if (!c.in_deal) { // we can disband TRICK here since the deal hasn't started
+            loop.disconnect(c);
+            return;
+        }
+        Message parsed;
+        if (status < 0 || !parse_TRICK(msg, parsed)) {
+            loop.disconnect(c);
+            return;
+        }
+        if (!playing || !c.prompted) {
+            send_WRONG(c);
+            return;
+        }
+        play(c, parsed);
+    }
+
+    void timeout(Connection &c) {
+        if (playing && c.prompted) {
+            count(metrics.trick_retries);
+            send_TRICK(c);
+        }
+    }
+};
+
+// REACTOR
+
+Reactor::Reactor(Lobby<ReactorTable> &lobby, int timeout, Metrics &metrics) :
+    epoll_fd(epoll_create1(EPOLL_CLOEXEC)), wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    timeout(timeout), lobby(lobby), metrics(metrics) {
+    if (epoll_fd == -1)
+        syserr("epoll_create1");
+    if (wake_fd == -1)
+        syserr("couldn't create eventfd");
+    epoll_event ev{.events = EPOLLIN, .data = {.fd = wake_fd}};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == -1)
+        syserr("epoll_ctl");
+}
+
+Reactor::~Reactor() {
+    stop();
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+void Reactor::add(std::unique_ptr<Connection> c) {
+    {
+        std::unique_lock<std::mutex> lock(incoming_mutex);
+        incoming.push_back(std::move(c));
+    }
+    increment_event_fd(wake_fd);
+}
+
+void Reactor::start() {
+    thread = std::thread(&Reactor::run, this);
+}
+
+void Reactor::stop() {
+    if (!thread.joinable())
+        return;
+    stopping.test_and_set();
+    increment_event_fd(wake_fd);
+    thread.join();
+}
+
+int Reactor::get_timeout() const noexcept {
+    return timeout;
+}
+
+template <class M>
+void Reactor::queue(Connection &c, const M &msg) {
+    if (c.broken || c.closing)
+        return;
+    bool idle = !c.send_data.has_pending();
+    c.send_data.queue(msg);
+    if (c.send_data.pending_bytes() > MAX_PENDING)
+        disconnect(c);
+    else if (idle)
+        dirty.push_back(c.fd); // written once the loop is done with this round of events
+}
+
+void Reactor::send(Connection &c, std::string_view msg) {
+    queue(c, msg);
+}
+
+void Reactor::send(Connection &c, const FrameRef &frame) {
+    queue(c, frame);
+}
+
+void Reactor::flush(Connection &c) {
+    TRACE_SPAN("Reactor::flush");
+    Cork cork(c.send_data);
+    while (c.send_data.has_pending()) {
+        ssize_t n = write_some(c.send_data);
+        if (n > 0)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!(c.events & EPOLLOUT)) {
+                c.events |= EPOLLOUT;
+                epoll_event ev{.events = c.events, .data = {.fd = c.fd}};
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+            }
+            return;
+        }
+        disconnect(c);
+        return;
+    }
+    if (c.events & EPOLLOUT) {
+        c.events &= ~EPOLLOUT;
+        epoll_event ev{.events = c.events, .data = {.fd = c.fd}};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+    if (c.closing)
+        disconnect(c);
+}
+
+void Reactor::flush_dirty() {
+    for (int fd: dirty) {
+        auto it = connections.find(fd);
+        if (it != connections.end() && !it->second->broken)
+            flush(*it->second);
+    }
+    dirty.clear();
+}
+
+void Reactor::arm_timer(Connection &c) {
+    c.timer = ++timer_generation;
+    if (timers.size() == timers.capacity()) { // make room from stale entries before growing
+        std::erase_if(timers, [this](const Timer &t) {
+            auto it = connections.find(t.fd);
+            return it == connections.end() || it->second->timer != t.generation;
+        });
+        std::ranges::make_heap(timers, std::greater<>());
+    }
+    timers.push_back({Clock::now() + std::chrono::seconds(timeout), c.fd, c.timer});
+    std::ranges::push_heap(timers, std::greater<>());
+}
+
+void Reactor::disarm_timer(Connection &c) noexcept {
+    c.timer = 0; // the entry in the heap gets stale and is skipped
+}
+
+void Reactor::close_after_flush(Connection &c) {
+    disarm_timer(c);
+    c.closing = true;
+    if (!c.send_data.has_pending())
+        disconnect(c);
+}
+
+void Reactor::disconnect(Connection &c) {
+    if (c.broken)
+        return;
+    c.broken = true;
+    disarm_timer(c);
+    to_close.push_back(c.fd);
+}
+
+void Reactor::release(Connection &c) {
+    if (c.table != nullptr)
+        c.table->leave(c);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.fd, nullptr);
+    close(c.fd);
+}
+
+void Reactor::reap() {
+    // leaving a table doesn't close anything else, so to_close is stable here
+    for (int fd: to_close) {
+        auto it = connections.find(fd);
+        if (it == connections.end())
+            continue;
+        release(*it->second);
+        connections.erase(it);
+    }
+    to_close.clear();
+}
+
+void Reactor::adopt_incoming() {
+    std::vector<std::unique_ptr<Connection>> batch;
+    {
+        std::unique_lock<std::mutex> lock(incoming_mutex);
+        batch.swap(incoming);
+    }
+    for (auto &ptr: batch) {
+        Connection &c = *ptr;
+        c.events = EPOLLIN | EPOLLRDHUP;
+        epoll_event ev{.events = c.events, .data = {.fd = c.fd}};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &ev) == -1) {
+            error("epoll_ctl");
+            release(c);
+            continue;
+        }
+        connections.emplace(c.fd, std::move(ptr));
+        if (to_close.capacity() < connections.size()) { // so that closing and queueing don't allocate
+            to_close.reserve(2 * connections.size());
+            dirty.reserve(2 * connections.size());
+        }
+        if (c.table != nullptr) {
+            c.table->sit(c);
+            handle_events(c, 0); // it may have sent more than IAM already
+        }
+        else
+            arm_timer(c); // deadline for IAM
+    }
+}
+
+void Reactor::handle_IAM(Connection &c, const std::string &line, int status) {
+    char seat;
+    uint64_t token = 0;
+    disarm_timer(c);
+    c.pass = HalfOpen::Pass();
+    if (status < 0 || (!parse_IAM(line, seat) && !parse_RESUME(line, seat, token))) {
+        disconnect(c);
+        return;
+    }
+    std::string busy;
+    bool resumed;
+    ReactorTable *table = lobby.take_seat(seat, busy, token, resumed);
+    if (table == nullptr) {
+        count(metrics.busy);
+        send(c, frame_BUSY(busy).view());
+        close_after_flush(c);
+        return;
+    }
+    c.table = table;
+    c.pos = get_index_from_seat(seat);
+    c.token = line.starts_with("RESUME") ? token : 0; // IAM gets no TOKEN
+    c.resumed = resumed;
+    if (&table->get_loop() == this) {
+        table->sit(c);
+        return;
+    }
+    // the table lives in another loop, hand the connection over
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.fd, nullptr);
+    c.events = 0;
+    auto it = connections.find(c.fd);
+    std::unique_ptr<Connection> ptr = std::move(it->second);
+    connections.erase(it);
+    table->get_loop().add(std::move(ptr));
+}
+
+void Reactor::handle_events(Connection &c, uint32_t events) {
+    TRACE_SPAN("Reactor::handle_events");
+    if (events & EPOLLOUT)
+        flush(c);
+    bool eof = false;
+    // epoll is level-triggered, so a single read is enough: what's left comes with the next event
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        ssize_t n = c.send_data.receive();
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            eof = true;
+        if (c.closing)
+            c.send_data.discard();
+    }
+    std::string line;
+    while (!c.broken && !c.closing) {
+        bool handshake = c.table == nullptr;
+        int status = c.send_data.take_line(line, handshake ? HELLO_SIZE : 100);
+        if (status == 0)
+            break;
+        c.send_data.log_message(line.c_str(), get_timestamp(), false);
+        if (handshake) {
+            int fd = c.fd;
+            handle_IAM(c, line, status);
+            if (!connections.contains(fd)) // handed over to another loop
+                return;
+        }
+        else
+            c.table->receive(c, line, status);
+    }
+    if (eof)
+        disconnect(c);
+}
+
+void Reactor::expire_timers() {
+    auto now = Clock::now();
+    while (!timers.empty() && timers.front().when <= now) {
+        std::ranges::pop_heap(timers, std::greater<>());
+        Timer t = timers.back();
+        timers.pop_back();
+        auto it = connections.find(t.fd);
+        if (it == connections.end() || it->second->timer != t.generation)
+            continue;
+        Connection &c = *it->second;
+        c.timer = 0;
+        if (c.table == nullptr) // no IAM in time
+            disconnect(c);
+        else
+            c.table->timeout(c);
+    }
+}
+
+void Reactor::run() {
+    epoll_event events[MAX_EVENTS];
+    while (!stopping.test()) {
+        int wait_ms = -1;
+        if (!timers.empty()) {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(timers.front().when - Clock::now());
+            wait_ms = static_cast<int>(std::max<long>(left.count(), 0));
+        }
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, wait_ms);
+        if (n < 0 && errno != EINTR)
+            syserr("epoll_wait");
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd) {
+                uint64_t u;
+                read(wake_fd, &u, sizeof u);
+                adopt_incoming();
+                continue;
+            }
+            auto it = connections.find(fd);
+            if (it != connections.end() && !it->second->broken)
+                handle_events(*it->second, events[i].events);
+        }
+        expire_timers();
+        flush_dirty();
+        reap();
+    }
+    // the game is over: send what's left and close everything
+    adopt_incoming();
+    drain();
+    for (auto &[fd, c]: connections)
+        release(*c);
+    connections.clear();
+}
+
+void Reactor::drain() {
+    const auto deadline = Clock::now() + std::chrono::seconds(timeout);
+    for (auto &[fd, c]: connections) {
+        c->table = nullptr;
+        c->events = EPOLLOUT; // what clients send doesn't matter any more
+        epoll_event ev{.events = c->events, .data = {.fd = fd}};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    epoll_event events[MAX_EVENTS];
+    while (true) {
+        for (auto &[fd, c]: connections) {
+            if (!c->broken && c->send_data.has_pending())
+                flush(*c); // as much as the socket takes
+            if (!c->send_data.has_pending())
+                disconnect(*c);
+        }
+        reap();
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - Clock::now());
+        if (connections.empty() || left.count() <= 0)
+            return;
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, static_cast<int>(left.count()));
+        if (n < 0 && errno != EINTR)
+            syserr("epoll_wait");
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == wake_fd) {
+                uint64_t u;
+                read(wake_fd, &u, sizeof u);
+            }
+        }
+    }
+}
+
+// REACTOR POOL
+
+ReactorPool::ReactorPool(size_t loops, const std::vector<Deal> &deals, size_t tables,
+                         int timeout, int game_over_fd, Logger &logger, Metrics &metrics, bool cork) :
+    lobby(tables, [this, &deals, &metrics, game_over_fd](size_t index) {
+        return std::make_unique<ReactorTable>(deals, *reactors[index % reactors.size()], metrics, game_over_fd);
+    }), logger(logger), metrics(metrics), cork(cork) {
+    for (size_t i = 0; i < loops; i++)
+        reactors.emplace_back(std::make_unique<Reactor>(lobby, timeout, metrics));
+    for (auto &reactor: reactors)
+        reactor->start();
+}
+
+ReactorPool::~ReactorPool() {
+    stop();
+}
+
+void ReactorPool::dispatch(int client_fd, Supervisor::Slot slot, HalfOpen::Pass pass,
+                           const sockaddr_storage &client_address, const sockaddr_storage &server_address) {
+    auto c = std::make_unique<Connection>(client_fd, std::move(slot), std::move(pass), server_address,
+                                          client_address, logger, metrics);
+    c->send_data.set_cork(cork);
+    reactors[next.fetch_add(1, std::memory_order_relaxed) % reactors.size()]->add(std::move(c));
+}
+
+void ReactorPool::stop() {
+    for (auto &reactor: reactors)
+        reactor->stop();
+}
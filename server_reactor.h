@@ -0,0 +1,104 @@
+#ifndef SERVER_REACTOR_H
+#define SERVER_REACTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "server_classes.h"
+
+struct Connection;
+class ReactorTable;
+
+// Single-threaded event loop: every player is a state machine driven by
+// epoll instead of a thread blocked in poll. Tables are bound to one loop.
+class Reactor {
+private:
+    using Clock = std::chrono::steady_clock;
+    struct Timer {
+        Clock::time_point when;
+        int fd;
+        uint64_t generation;
+        bool operator>(const Timer &other) const noexcept {
+            return when > other.when;
+        }
+    };
+
+    const int epoll_fd;
+    const int wake_fd;
+    const int timeout;
+    Lobby<ReactorTable> &lobby;
+    Metrics &metrics;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    std::vector<Timer> timers; // a min-heap, entries of disarmed timers get stale
+    uint64_t timer_generation = 0;
+    std::vector<int> to_close;
+    std::vector<int> dirty; // connections with messages not written yet
+    std::mutex incoming_mutex;
+    std::vector<std::unique_ptr<Connection>> incoming;
+    std::atomic_flag stopping = ATOMIC_FLAG_INIT;
+    std::thread thread;
+
+    void run();
+    void adopt_incoming();
+    void handle_events(Connection &c, uint32_t events);
+    void handle_IAM(Connection &c, const std::string &line, int status);
+    void expire_timers();
+    void reap();
+    // sends what's queued, for timeout seconds at most, and closes the
+    // connections done with it; the rest is left for the caller
+    void drain();
+    void flush(Connection &c);
+    void flush_dirty();
+    void release(Connection &c);
+    template <class M>
+    void queue(Connection &c, const M &msg);
+public:
+    Reactor(Lobby<ReactorTable> &lobby, int timeout, Metrics &metrics);
+    ~Reactor();
+    Reactor(const Reactor &) = delete;
+    Reactor &operator=(const Reactor &) = delete;
+
+    // thread-safe: hands a connection over to this loop
+    void add(std::unique_ptr<Connection> c);
+    void start();
+    void stop();
+
+    // following functions may be called only from the loop's own thread
+    void send(Connection &c, std::string_view msg);
+    void send(Connection &c, const FrameRef &frame);
+    void arm_timer(Connection &c);
+    void disarm_timer(Connection &c) noexcept;
+    // closes the connection once its pending messages are sent
+    void close_after_flush(Connection &c);
+    void disconnect(Connection &c);
+    [[nodiscard]] int get_timeout() const noexcept;
+};
+
+// Runs the event-driven mode: owns the loops and the lobby shared by them.
+class ReactorPool {
+private:
+    Lobby<ReactorTable> lobby;
+    Logger &logger;
+    Metrics &metrics;
+    const bool cork;
+    std::vector<std::unique_ptr<Reactor>> reactors;
+    std::atomic<size_t> next{0};
+public:
+    ReactorPool(size_t loops, const std::vector<Deal> &deals, size_t tables,
+                int timeout, int game_over_fd, Logger &logger, Metrics &metrics, bool cork);
+    ~ReactorPool();
+    // thread-safe: hands a freshly accepted, non-blocking client over to
+    // one of the loops (round-robin), the slot and pass go with it
+    void dispatch(int client_fd, Supervisor::Slot slot, HalfOpen::Pass pass,
+                  const sockaddr_storage &client_address, const sockaddr_storage &server_address);
+    void stop();
+};
+
+#endif //SERVER_REACTOR_H
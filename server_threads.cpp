@@ -1,376 +1,503 @@
 #include "server_threads.h"
 
 #include <algorithm>
+#include <fcntl.h>
 #include <iostream>
 #include <poll.h>
-#include <regex>
-#include <sys/eventfd.h>
+#include <sys/epoll.h>
 
 #include "common.h"
 #include "err.h"
 #include "card.h"
+#include "protocol.h"
 #include "server_classes.h"
-
-// GLOBAL VARIABLES
-
-static ActiveMap active;
-static GameState game;
-// pipes, message when: (a) game is paused (b) game is unpaused
-// (c) it's player's turn (d) trick is over (time to send TAKEN)
-int to_pl[4][2];
-// increment when: (a) player disconnects (b) trick is over
-// (c) deal is over, so we need to sync threads
-const int pl_to_gm = eventfd(0, EFD_SEMAPHORE);
-
-// defines of pipe messages
-constexpr char PAUSE = 'P';
-constexpr char PLAY = 'C';
-constexpr char TURN = 'T';
-constexpr char TAKE = 'O';
-
-// AUXILIARY FUNCTIONS
-
-char get_from_pipe (int pipe) {
-    char msg;
-    read(pipe, &msg, 1);
-    return msg;
-}
+#include "trace.h"
 
 // SENDS/RECEIVES
 
-bool get_deal(std::ifstream &desc, int &current_deal, char &starting_client) {
-    if (desc.eof())
+bool get_deal(const std::vector<Deal> &deals, size_t &next, GameState &game) {
+    if (next == deals.size())
         return false;
-    static std::string tmp;
-    std::getline(desc, tmp);
-    current_deal = tmp[0] - '0';
-    starting_client = tmp[1];
-    for (int i = 0; i < 4; i++) {
-        std::getline(desc, tmp);
-        game.start_game(i, parse_cards(tmp), current_deal, starting_client);
-    }
+    game.start_deal(deals[next++]);
     return true;
 }
 
-bool send_msg(SendData &send_data, const char *msg, size_t len) {
-    return (writen(send_data, msg, len) == static_cast<ssize_t>(len));
+bool send_msg(SendData &send_data, const Frame &frame) {
+    return (writen(send_data, frame.data(), frame.size()) == static_cast<ssize_t>(frame.size()));
+}
+
+void send_pending(SendData &send_data) {
+    if (!flush(send_data))
+        throw std::runtime_error("sending queued messages");
 }
 
 void send_BUSY(SendData &send_data, const std::string &occupied) {
-    const std::string s = "BUSY" + occupied + "\r\n";
-    if (!send_msg(send_data, s.c_str(), s.size()))
+    if (!send_msg(send_data, frame_BUSY(occupied)))
         throw std::runtime_error("sending BUSY");
 }
 
-void send_DEAL(SendData &send_data, const std::vector<Card> &hand) {
-    std::string s = "DEAL" + std::to_string(game.get_deal()) +
-        game.get_first() + cards_to_string(hand) + "\r\n";
-    if (!send_msg(send_data, s.c_str(), s.size()))
-        throw std::runtime_error("sending DEAL");
+// DEAL, TAKEN and SCORE are queued: they go out together with what follows them.
+// TAKEN, SCORE and TOTAL are the game master's shared frames.
+void send_DEAL(SendData &send_data, const DealState &game, const Hand &hand) {
+    send_data.queue(frame_DEAL(game.get_deal(), game.get_first(), hand).view());
+}
+
+void send_TOKEN(SendData &send_data, char seat, uint64_t token) {
+    send_data.queue(frame_token("TOKEN", seat, token).view());
+}
+
+void send_STATE(SendData &send_data, const DealState &game, const Hand &hand) {
+    send_data.queue(frame_STATE(game.get_deal(), game.get_first(), hand).view());
 }
 
-void send_WRONG(SendData &send_data, int trick) {
-    std::string s = "WRONG" + std::to_string(trick) + "\r\n";
-    if (!send_msg(send_data, s.c_str(), s.size()))
+void send_WRONG(SendData &send_data, Metrics &metrics, int trick) {
+    count(metrics.wrong);
+    if (!send_msg(send_data, frame_WRONG(trick)))
         throw std::runtime_error("sending WRONG");
 }
 
-void send_TAKEN(SendData &send_data, int trick) {
-    std::string s = game.get_TAKEN(trick);
-    if (!send_msg(send_data, s.c_str(), s.size()))
-        throw std::runtime_error("sending TRICK");
+void send_TAKEN(SendData &send_data, const Table &table, int trick) {
+    send_data.queue(table.taken[trick - 1]);
 }
 
-void send_SCORE(SendData &send_data) {
-    std::string s = game.get_SCORE();
-    if (!send_msg(send_data, s.c_str(), s.size()))
-        throw std::runtime_error("sending SCORE");
-    s = game.get_TOTAL();
-    if (!send_msg(send_data, s.c_str(), s.size()))
+void send_SCORE(SendData &send_data, const Table &table) {
+    send_data.queue(table.score);
+    send_data.queue(table.total);
+    if (!flush(send_data))
         throw std::runtime_error("sending TOTAL");
 }
 
-std::pair<int, std::vector<Card>> get_TRICK(SendData &send_data, int pos, int timeout) {
+std::pair<int, Card> get_TRICK(SendData &send_data, Table &table, int pos, int timeout) {
+    Mailbox &box = table.seats[pos];
     std::string trick;
-    std::smatch matches;
-    pollfd fds[2];
-    bool waiting_for_unpause = false;
+    Message parsed;
     while (true) {
-        fds[0] = {.fd = to_pl[pos][0], .events = POLLIN, .revents = 0};
-        fds[1] = {.fd = send_data.get_fd(), .events = static_cast<short>(waiting_for_unpause ? POLLRDHUP : POLLIN), .revents = 0};
-        if (poll(fds, 2, waiting_for_unpause ? -1 : timeout) == 0) // timeout
+        Mailbox::Mail mail = box.read();
+        pollfd client = {.fd = send_data.get_fd(), .events = static_cast<short>(mail.paused ? POLLRDHUP : POLLIN), .revents = 0};
+        // a message may be already waiting in the receive buffer
+        bool buffered = !mail.paused && send_data.has_buffered();
+        if (buffered)
+            client.revents = POLLIN;
+        else if (box.wait(mail, client, mail.paused ? -1 : timeout) == 0)
             throw std::runtime_error(timeout_trick_msg);
-        if (fds[0].revents & POLLIN) {
-            char msg = get_from_pipe(to_pl[pos][0]);
-            switch (msg) {
-                case PAUSE:
-                    waiting_for_unpause = true;
-                    break;
-                case PLAY:
-                    waiting_for_unpause = false;
-                    break;
-                default: // should not happen
-                    continue;
-            }
-        }
-        // client disconnected
-        if (fds[1].revents & POLLRDHUP) {
-            if (waiting_for_unpause)
-                write(to_pl[pos][1], &PAUSE, 1);
-            write(to_pl[pos][1], &TURN, 1);
+        if (client.revents & POLLRDHUP)
             throw std::runtime_error("client disconnected");
-        }
         // we got a trick (or client disconnected)
-        if (fds[1].revents & POLLIN)
+        if (client.revents & POLLIN)
             break;
     }
     if (get_line(send_data, trick) <= 0) { // known issue: doesn't check if game is paused here
         if (errno == EAGAIN)
             throw std::runtime_error(timeout_trick_msg);
-        else {
-            write(to_pl[pos][1], &TURN, 1);
+        else
             throw std::runtime_error("couldn't receive TRICK");
-        }
-    }
-    if (std::regex_match(trick, matches, TRICK_REGEX)) {
-        std::vector<Card> cards;
-        for (size_t i = 2; i < matches.size() && !matches[i].str().empty(); i++)
-            cards.emplace_back(matches[i].str());
-        return {std::stoi(matches[1].str()), cards};
     }
-    else {
-        write(to_pl[pos][1], &TURN, 1);
+    if (!parse_TRICK(trick, parsed))
         throw std::runtime_error("invalid TRICK: " + trick);
-    }
+    if (parsed.cards_no != 1)
+        throw std::runtime_error("Incorrect answer to TRICK (cards no. >1)");
+    return {parsed.number, parsed.cards[0]};
 }
 
 // OTHER FUNCTIONS
 
-void wait_for_deal (SendData &send_data, const int &pos, std::vector <Card> &hand) {
-    pollfd fds[2];
-    char msg = PAUSE;
+// waits for a deal other than dealt, returns its number or 0 if the game is over
+uint32_t wait_for_deal(SendData &send_data, Table &table, int pos, uint32_t dealt) {
+    Mailbox &box = table.seats[pos];
     while (true) {
-        fds[0] = {.fd = to_pl[pos][0], .events = POLLIN, .revents = 0};
-        fds[1] = {.fd = send_data.get_fd(), .events = POLLIN, .revents = 0};
-        poll(fds, 2, -1);
-        // we got a message from gm: maybe unpause?
-        if (fds[0].revents & POLLIN) {
-            if (msg != PAUSE)
-                write(to_pl[pos][1], &msg, 1);
-            msg = get_from_pipe(to_pl[pos][0]);
-            if (msg == PLAY)
-                break;
-            else
-                continue;
+        Mailbox::Mail mail = box.read();
+        if (!mail.paused && mail.deal != dealt) {
+            // the game master checks reading after pausing, we check the other way round
+            box.reading.store(mail.deal);
+            if (box.read() == mail)
+                return mail.deal;
+            box.reading.store(0);
+            continue;
+        }
+        if (mail.over)
+            return 0;
+        pollfd client = {.fd = send_data.get_fd(), .events = POLLIN, .revents = 0};
+        if (send_data.has_buffered())
+            client.revents = POLLIN;
+        else {
+            send_pending(send_data); // before blocking
+            box.wait(mail, client, -1);
         }
         // on client_fd we'd get either disconnect or unwanted messages
         // we can even disband TRICK here since the game hasn't started
-        if (fds[1].revents & POLLIN) {
-            write(to_pl[pos][1], &PAUSE, 1);
+        if (client.revents & POLLIN)
             throw std::runtime_error("client sent unexpected message or disconnected");
-        }
-    }
-    hand = game.get_hand(pos);
-    send_DEAL(send_data, hand);
-    int i = 1;
-    while (game.get_trick(i).size() == 4) {
-        send_TAKEN(send_data, i);
-        const auto &trick = game.get_trick(i);
-        for (const Card &c: trick)
-            if (std::find(hand.begin(), hand.end(), c) != hand.end())
-                std::erase(hand, c);
-        i++;
     }
 }
 
-char wait_for_turn (SendData send_data, int pos) {
-    pollfd fds[2];
-    bool waiting_for_unpause = false;
+// true if it's the player's turn in trick_no, false once the trick is taken
+bool wait_for_turn(SendData &send_data, Table &table, int pos, int trick_no) {
+    TRACE_SPAN("wait_for_turn");
+    Mailbox &box = table.seats[pos];
     while (true) {
-        fds[0] = {.fd = to_pl[pos][0], .events = POLLIN, .revents = 0};
-        fds[1] = {.fd = send_data.get_fd(), .events = static_cast<short>(waiting_for_unpause ? POLLRDHUP : POLLIN), .revents = 0};
-        poll(fds, 2, -1);
+        Mailbox::Mail mail = box.read();
+        if (mail.taken >= trick_no)
+            return false;
+        if (!mail.paused && mail.turn == trick_no)
+            return true;
+        pollfd client = {.fd = send_data.get_fd(), .events = static_cast<short>(mail.paused ? POLLRDHUP : POLLIN), .revents = 0};
+        bool buffered = !mail.paused && send_data.has_buffered();
+        if (buffered)
+            client.revents = POLLIN;
+        else {
+            send_pending(send_data); // before blocking
+            box.wait(mail, client, -1);
+        }
         // on client_fd we'd get either disconnect or unwanted messages
-        if (fds[1].revents & POLLRDHUP) {
-            // waiting_for_unpause = true
-            write(to_pl[pos][1], &PAUSE, 1);
+        if (client.revents & POLLRDHUP)
             throw std::runtime_error("client disconnected");
-        }
-        if (fds[1].revents & POLLIN) {
-            // waiting_for_unpause = false
+        if (client.revents & POLLIN) {
             std::string msg;
+            Message parsed;
             ssize_t read_len = get_line(send_data, msg);
-            if (read_len > 0 && std::regex_match(msg, TRICK_REGEX)) {
-                send_WRONG(send_data, game.get_trick_no());
-                continue;
-            }
+            if (read_len > 0 && parse_TRICK(msg, parsed))
+                send_WRONG(send_data, table.metrics, trick_no);
             else if (read_len == 0)
                 throw std::runtime_error("client disconnected");
             else
                 throw std::runtime_error("got from client");
         }
-        // else we got a message on pipe
-        char msg = get_from_pipe(to_pl[pos][0]);
-        switch (msg) {
-            case PAUSE:
-                waiting_for_unpause = true;
-                break;
-            case PLAY:
-                waiting_for_unpause = false;
-                break;
-            default:
-                return msg;
-        }
     }
 }
 
-bool incorrect_color(const std::vector<Card> &hand, const std::vector<Card> &trick, const Card &c) {
-    if (trick.empty() || trick[0].get_suit() == c.get_suit())
-        return false;
-    return std::ranges::any_of(hand, [&trick](const Card &c){return c.get_suit() == trick[0].get_suit();});
+// the player at pos has played in trick_no: pass the turn on or end the trick
+void played(Table &table, int pos, int trick_no) {
+    table.seats[pos].post([](Mailbox::Mail &mail) { mail.turn = 0; });
+    if (table.game.get_trick(trick_no).size() == 4) {
+        table.tricks_done.store(trick_no);
+        table.notify_master();
+    }
+    else
+        table.seats[(pos + 1) % 4].post([trick_no](Mailbox::Mail &mail) {
+            mail.turn = static_cast<uint8_t>(trick_no);
+        });
+}
+
+void leave(Table &table, int pos) {
+    table.seats[pos].reading.store(0);
+    table.active.leave(pos);
+    table.notify_master();
 }
 
 // ACTUAL THREAD FUNCTIONS
 
-void handle_player(
-        const int &client_fd,
-        const sockaddr_storage &client_address,
-        const sockaddr_storage &server_address,
-        const int &timeout,
-        Log &log
-) {
+void handle_player(SendData &send_data, const int &timeout, Metrics &metrics, Lobby<Table> &lobby) {
+    const int client_fd = send_data.get_fd();
     timeval to = {.tv_sec = timeout, .tv_usec = 0};
     setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &to, sizeof to);
     setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &to, sizeof to);
     char seat;
     int pos = 0;
     bool connected = false;
-    SendData send_data(client_fd, server_address, client_address);
+    Table *table = nullptr;
     try {
-        seat = get_IAM(send_data);
-        std::string ans = active.setActive(seat);
-        if (!ans.empty()) {
+        uint64_t token;
+        bool tokens;
+        seat = get_IAM(send_data, token, tokens);
+        std::string ans;
+        bool resumed;
+        table = lobby.take_seat(seat, ans, token, resumed);
+        if (table == nullptr) {
+            count(metrics.busy);
             send_BUSY(send_data, ans);
             close(client_fd);
             return;
         }
         pos = get_index_from_seat(seat);
         connected = true;
-        char msg = get_from_pipe(to_pl[pos][0]); // acknowledge game is paused
-        while (msg != PAUSE) {
-            // this is not busy waiting because PAUSE is guaranteed to be in the queue
-            write(to_pl[pos][1], &msg, 1);
-            msg = get_from_pipe(to_pl[pos][0]);
-        }
-        std::vector<Card> hand;
-        while (!active.is_over()) {
-            wait_for_deal(send_data, pos, hand);
-            int trick_no = game.get_trick_no();
-            while (trick_no <= 13) {
-                char job = wait_for_turn(send_data, pos);
-                if (job == TURN) {
-                    const auto &trick = game.get_trick(trick_no);
+        if (tokens) // only a client that sent RESUME knows the message
+            send_TOKEN(send_data, seat, token);
+        auto &game = table->game;
+        Hand hand;
+        uint32_t dealt = 0;
+        while ((dealt = wait_for_deal(send_data, *table, pos, dealt)) != 0) {
+            // tricks already taken (read before the snapshot, so it has them all)
+            const Mailbox::Mail mail = table->seats[pos].read();
+            const int taken = mail.deal == dealt ? mail.taken : 0;
+            // others may be playing already: we read snapshots, the game is written only on our turn
+            DealState view = game.snapshot();
+            int first_trick = 1;
+            send_data.new_deal(); // the last deal's frames are flushed
+            if (resumed && taken > 0) {
+                // a client that knows the token gets its cards and the last trick only
+                first_trick = taken + 1;
+                hand = view.get_hand_before(pos, first_trick);
+                send_STATE(send_data, view, hand);
+                send_TAKEN(send_data, *table, taken);
+            }
+            else {
+                hand = view.get_hand(pos);
+                send_DEAL(send_data, view, hand);
+            }
+            for (int trick_no = first_trick; trick_no <= 13; trick_no++) {
+                // after playing we wait for the trick to be taken
+                while (wait_for_turn(send_data, *table, pos, trick_no)) {
+                    view = game.snapshot();
+                    const auto trick = view.get_trick(trick_no);
                     send_TRICK(send_data, trick_no, trick);
+                    auto asked = Metrics::Clock::now();
                     while (true) {
                         try {
-                            auto [no, v] = get_TRICK(send_data, pos, timeout * 1000);
-                            if (v.size() != 1) {
-                                write(to_pl[pos][1], &TURN, 1);
-                                throw std::runtime_error("Incorrect answer to TRICK (cards no. >1)");
-                            }
-                            if (no != trick_no || incorrect_color(hand, trick, v[0]) || std::erase(hand, v[0]) == 0) {
-                                send_WRONG(send_data, trick_no);
+                            auto [no, card] = get_TRICK(send_data, *table, pos, timeout * 1000);
+                            if (no != trick_no || incorrect_color(hand, trick, card) || !hand.remove(card)) {
+                                send_WRONG(send_data, metrics, trick_no);
                                 continue;
                             }
-                            game.play(v[0]);
+                            game.play(card);
+                            metrics.move_latency.observe(Metrics::Clock::now() - asked);
                             break;
                         }
                         catch (const std::runtime_error &e) {
-                            if (e.what() == timeout_trick_msg)
+                            if (e.what() == timeout_trick_msg) {
+                                count(metrics.trick_retries);
                                 send_TRICK(send_data, trick_no, trick);
+                            }
                             else
                                 throw e;
                         }
                     }
-                    if (trick.size() == 4)
-                        increment_event_fd(pl_to_gm);
-                    else
-                        write(to_pl[(pos + 1) % 4][1], &TURN, 1);
-                    wait_for_turn(send_data, pos); // waiting for end of trick, should get TAKE
-                }
-                else { // job == TAKE
-                    // previous client on this seat played a card in this trick -> find it
-                    const auto &trick = game.get_trick(trick_no);
-                    for (const Card &c: trick)
-                        if (std::find(hand.begin(), hand.end(), c) != hand.end())
-                            std::erase(hand, c);
+                    played(*table, pos, trick_no);
                 }
-                send_TAKEN(send_data, trick_no);
-                trick_no++;
+                // also finds the card if a previous client on this seat played it
+                view = game.snapshot();
+                for (const Card &c: view.get_trick(trick_no))
+                    hand.remove(c);
+                send_TAKEN(send_data, *table, trick_no);
+                if (view.is_last_trick(trick_no))
+                    break;
             }
-            send_SCORE(send_data);
-            increment_event_fd(pl_to_gm); // barrier
-            get_from_pipe(to_pl[pos][0]); // gets PAUSE
+            send_SCORE(send_data, *table);
+            table->seats[pos].reading.store(0);
+            table->notify_master();
         }
     }
     catch (const std::runtime_error &e) {
         error(e.what());
         if (connected)
-            active.disconnect(pos, pl_to_gm);
+            leave(*table, pos);
         close(client_fd);
-        send_data.append_to_log(log);
         return;
     }
-    active.disconnect(pos, pl_to_gm);
-    send_data.append_to_log(log);
-
+    leave(*table, pos);
     close(client_fd);
-    close(to_pl[pos][0]);
 }
 
-void game_master(std::ifstream &desc, const int &game_over_fd) {
-    for (const auto fds: to_pl) {
-        pipe(fds);
-        write(fds[1], &PAUSE, 1);
+// waits until trick is over, pausing the game while a seat is empty
+void wait_for_trick(Table &table, int trick) {
+    TRACE_SPAN("wait_for_trick");
+    while (true) {
+        uint32_t seen = table.events.load();
+        if (table.tricks_done.load() >= trick)
+            return;
+        if (!table.active.is_four()) {
+            count(table.metrics.pauses);
+            table.post_all([](int, Mailbox::Mail &mail) { mail.paused = true; });
+            table.active.wait_for_four();
+            table.post_all([](int, Mailbox::Mail &mail) { mail.paused = false; });
+            count(table.metrics.resumes);
+            continue;
+        }
+        table.events.wait(seen);
     }
-    int current_deal;
-    char starting_client;
-    while (get_deal(desc, current_deal, starting_client)) {
-        active.wait_for_four();
-        clear_event_fd(pl_to_gm);
-        for (const auto fds: to_pl)
-            write(fds[1], &PLAY, 1);
-        int tricks = 0;
-        while (tricks < 13) {
-            write(to_pl[game.get_pos()][1], &TURN, 1);
-            while (true) {
-                decrement_event_fd(pl_to_gm); // trick or disconnect
-                if (active.is_four()) {
-                    tricks++;
-                    for (const auto fds: to_pl)
-                        write(fds[1], &TAKE, 1); // let players know trick is over
-                    break;
-                }
-                else {
-                    for (const auto fds: to_pl)
-                        write(fds[1], &PAUSE, 1); // game paused
-                    active.wait_for_four();
-                    clear_event_fd(pl_to_gm);
-                    for (const auto fds: to_pl)
-                        write(fds[1], &PLAY, 1); // let players know game is back on
+}
+
+// waits until no player is sending the deal any more
+void wait_for_readers(Table &table, uint32_t deal) {
+    while (true) {
+        uint32_t seen = table.events.load();
+        bool done = true;
+        for (const Mailbox &box: table.seats)
+            if (box.reading.load() == deal)
+                done = false;
+        if (done)
+            return;
+        table.events.wait(seen);
+    }
+}
+
+void game_master(Table &table, const int &game_over_fd) {
+    auto &game = table.game;
+    uint32_t deal = 0;
+    while (get_deal(table.deals, table.next_deal, game)) {
+        deal++;
+        table.tricks_done.store(0);
+        table.active.wait_for_four();
+        table.post_all([deal](int, Mailbox::Mail &mail) {
+            mail = {.deal = deal, .turn = 0, .taken = 0, .paused = false};
+        });
+        // the turn goes last: the leader may pass it on before post_all is done
+        table.seats[game.get_pos()].post([](Mailbox::Mail &mail) { mail.turn = 1; });
+        auto started = Metrics::Clock::now();
+        for (int trick = 1; ; trick++) {
+            wait_for_trick(table, trick);
+            // the deal is paused after its last trick until the next one starts
+            const DealState view = game.snapshot();
+            const bool last = view.is_deal_over();
+            {
+                TRACE_SPAN("game_master: TAKEN handoff");
+                table.taken[trick - 1] = FrameRef(view.get_TAKEN(trick));
+                if (last) {
+                    table.score = FrameRef(view.get_SCORE());
+                    table.total = FrameRef(view.get_TOTAL());
                 }
+                table.post_all([trick, last](int, Mailbox::Mail &mail) {
+                    mail.taken = static_cast<uint8_t>(trick);
+                    mail.paused = last;
+                });
+            }
+            if (last) {
+                table.metrics.deal_duration.observe(Metrics::Clock::now() - started);
+                break;
             }
+            table.seats[view.get_pos()].post([trick](Mailbox::Mail &mail) {
+                mail.turn = static_cast<uint8_t>(trick + 1);
+            });
+        }
+        wait_for_readers(table, deal); // de facto barrier
+        if (table.next_deal == table.deals.size()) {
+            table.active.end_game();
+            table.post_all([](int, Mailbox::Mail &mail) { mail.over = true; });
         }
-        decrement_event_fd(pl_to_gm, 4); // de facto barrier
-        if (desc.peek() == EOF)
-            active.end_game();
-        for (const auto fds: to_pl)
-            write(fds[1], &PAUSE, 1);
     }
     // end the game
     increment_event_fd(game_over_fd);
-    for (const auto &fds: to_pl)
-        close(fds[1]);
-    decrement_event_fd(pl_to_gm, 4); // de facto join (catches disconnects)
-    close(pl_to_gm);
-}
\ No newline at end of file
+}
+
+// LOBBY
+
+std::unique_ptr<Table> open_table(const std::vector<Deal> &deals, const int &game_over_fd, Metrics &metrics) {
+    auto table = std::make_unique<Table>(deals, metrics);
+    table->master = std::thread(game_master, std::ref(*table), game_over_fd);
+    return table;
+}
+
+// HANDSHAKER
+
+Handshaker::Handshaker(int timeout, Start start) :
+    epoll_fd(epoll_create1(EPOLL_CLOEXEC)), wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    timeout(timeout), start(std::move(start)) {
+    if (epoll_fd == -1)
+        syserr("epoll_create1");
+    if (wake_fd == -1)
+        syserr("couldn't create eventfd");
+    epoll_event ev{.events = EPOLLIN, .data = {.fd = wake_fd}};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == -1)
+        syserr("epoll_ctl");
+    thread = std::thread(&Handshaker::run, this);
+}
+
+Handshaker::~Handshaker() {
+    stop();
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+void Handshaker::add(std::unique_ptr<SendData> send_data, Supervisor::Slot slot, HalfOpen::Pass pass) {
+    {
+        std::unique_lock<std::mutex> lock(incoming_mutex);
+        incoming.push_back({.send_data = std::move(send_data), .slot = std::move(slot), .pass = std::move(pass)});
+    }
+    increment_event_fd(wake_fd);
+}
+
+void Handshaker::stop() {
+    if (!thread.joinable())
+        return;
+    stopping.test_and_set();
+    increment_event_fd(wake_fd);
+    thread.join();
+}
+
+void Handshaker::adopt_incoming() {
+    std::vector<Client> batch;
+    {
+        std::unique_lock<std::mutex> lock(incoming_mutex);
+        batch.swap(incoming);
+    }
+    const auto deadline = Clock::now() + timeout;
+    for (Client &c: batch) {
+        const int fd = c.send_data->get_fd();
+        epoll_event ev{.events = EPOLLIN | EPOLLRDHUP, .data = {.fd = fd}};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            error("epoll_ctl");
+            c.send_data.reset();
+            close(fd);
+            continue;
+        }
+        c.id = next_id++;
+        deadlines.push_back({.when = deadline, .fd = fd, .id = c.id});
+        clients.emplace(fd, std::move(c));
+    }
+}
+
+void Handshaker::drop(int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    clients.erase(fd);
+    close(fd);
+}
+
+void Handshaker::handle_events(int fd) {
+    auto it = clients.find(fd);
+    if (it == clients.end())
+        return;
+    SendData &send_data = *it->second.send_data;
+    ssize_t n = send_data.receive();
+    if (send_data.has_line(HELLO_SIZE)) {
+        // the rest (and whether it's IAM at all) is for the player thread
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        int flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+        Client c = std::move(it->second);
+        clients.erase(it);
+        c.pass = HalfOpen::Pass();
+        start(std::move(c.send_data), std::move(c.slot));
+    }
+    else if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        drop(fd);
+}
+
+void Handshaker::expire() {
+    const auto now = Clock::now();
+    while (!deadlines.empty() && deadlines.front().when <= now) {
+        const Deadline d = deadlines.front();
+        deadlines.pop_front();
+        auto it = clients.find(d.fd);
+        if (it != clients.end() && it->second.id == d.id) // no IAM in time
+            drop(d.fd);
+    }
+}
+
+void Handshaker::run() {
+    epoll_event events[64];
+    while (!stopping.test()) {
+        int wait_ms = -1;
+        if (!deadlines.empty()) {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(deadlines.front().when - Clock::now());
+            wait_ms = static_cast<int>(std::max<long>(left.count(), 0));
+        }
+        int n = epoll_wait(epoll_fd, events, 64, wait_ms);
+        if (n < 0 && errno != EINTR)
+            syserr("epoll_wait");
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == wake_fd) {
+                uint64_t u;
+                read(wake_fd, &u, sizeof u);
+                adopt_incoming();
+            }
+            else
+                handle_events(events[i].data.fd);
+        }
+        expire();
+    }
+    adopt_incoming();
+    for (auto &[fd, c]: clients) {
+        c.send_data.reset();
+        close(fd);
+    }
+    clients.clear();
+}
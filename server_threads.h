@@ -2,17 +2,78 @@
 #define SERVER_PLAYERS_H
 
 #include <arpa/inet.h>
-#include <fstream>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include "common.h"
+#include "server_classes.h"
 
-void handle_player(
-    const int &client_fd,
-    const sockaddr_storage &client_address,
-    const sockaddr_storage &server_address,
-    const int &timeout,
-    Log &log
-);
+// Waits for the first message of new clients, all of them on a single
+// thread (epoll on non-blocking sockets), so a client that is slow or
+// idle before IAM doesn't take a player thread. A client has timeout
+// seconds for the whole message, then it's closed. Once the message is
+// in, its socket is made blocking again and the client goes to start.
+class Handshaker {
+public:
+    using Start = std::function<void(std::unique_ptr<SendData>, Supervisor::Slot)>;
+private:
+    using Clock = std::chrono::steady_clock;
+    struct Client {
+        std::unique_ptr<SendData> send_data;
+        Supervisor::Slot slot;
+        HalfOpen::Pass pass;
+        uint64_t id = 0;
+    };
+    struct Deadline {
+        Clock::time_point when;
+        int fd;
+        uint64_t id; // the client's, a later one may get the same fd
+    };
 
-void game_master(std::ifstream &desc, const int &game_over_fd);
+    const int epoll_fd;
+    const int wake_fd;
+    const std::chrono::seconds timeout;
+    const Start start;
+    std::unordered_map<int, Client> clients;
+    std::deque<Deadline> deadlines; // in order, as every client gets the same timeout
+    uint64_t next_id = 1;
+    std::mutex incoming_mutex;
+    std::vector<Client> incoming;
+    std::atomic_flag stopping = ATOMIC_FLAG_INIT;
+    std::thread thread;
+
+    void run();
+    void adopt_incoming();
+    void handle_events(int fd);
+    void expire();
+    void drop(int fd);
+public:
+    Handshaker(int timeout, Start start);
+    ~Handshaker();
+    Handshaker(const Handshaker &) = delete;
+    Handshaker &operator=(const Handshaker &) = delete;
+
+    // thread-safe: waits for the first message on send_data's (non-blocking) socket
+    void add(std::unique_ptr<SendData> send_data, Supervisor::Slot slot, HalfOpen::Pass pass);
+    // closes the clients still waiting, none is started once it returns
+    void stop();
+};
+
+// starts deals[next++], false if there are none left
+bool get_deal(const std::vector<Deal> &deals, size_t &next, GameState &game);
+
+// serves a client whose first message is in send_data's buffer already
+// (see Handshaker), closes its socket
+void handle_player(SendData &send_data, const int &timeout, Metrics &metrics, Lobby<Table> &lobby);
+
+void game_master(Table &table, const int &game_over_fd);
+
+// creates a table and starts its game master
+std::unique_ptr<Table> open_table(const std::vector<Deal> &deals, const int &game_over_fd, Metrics &metrics);
 
 #endif //SERVER_PLAYERS_H
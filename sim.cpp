@@ -0,0 +1,336 @@
+// Offline tournament: plays deals with no server and no sockets, pitting
+// the client's strategies against each other on the rules engine. Every
+// deal is played four times, with the strategies moved one seat round
+// each time, so each of them gets every hand (luck of the cards cancels
+// out). Deals are spread over threads which steal work from each other,
+// and the per-strategy points are merged at the end.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+#include "engine.h"
+#include "err.h"
+#include "strategy.h"
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    struct sim_config {
+        std::array<std::string, 4> strategies = {"heuristic", "lowest", "lowest", "lowest"};
+        size_t deals = 10000;
+        int type = 0; // 0 - random
+        uint64_t seed = 1;
+        unsigned threads = 0; // 0 - one per hardware thread
+        std::chrono::milliseconds budget{5}; // per move, for mc
+        std::string filename; // empty - random deals
+    };
+
+    [[noreturn]] void usage() {
+        fatal("possible options:\n"
+              "\t\t-p <value> four strategies, comma-separated (optional, default: heuristic,lowest,lowest,lowest)\n"
+              "\t\t-d <value> number of deals (optional, default: 10000, or each deal of the file once)\n"
+              "\t\t-f <value> deal file (optional, default: random deals)\n"
+              "\t\t-t <value> type of random deals (optional, default: any)\n"
+              "\t\t-s <value> seed of random deals (optional, default: 1)\n"
+              "\t\t-j <value> threads (optional, default: one per hardware thread)\n"
+              "\t\t-b <value> milliseconds per move of mc strategies (optional, default: 5)\n");
+    }
+
+    sim_config get_sim_config(int argc, char *argv[]) {
+        sim_config ans;
+        bool deals_set = false;
+        int opt;
+        while ((opt = getopt(argc, argv, "p:d:f:t:s:j:b:")) != -1) {
+            switch (opt) {
+                case 'p': {
+                    std::istringstream names(optarg);
+                    size_t n = 0;
+                    for (std::string name; std::getline(names, name, ',');) {
+                        if (n == 4)
+                            usage();
+                        ans.strategies[n++] = name;
+                    }
+                    if (n != 4)
+                        usage();
+                    break;
+                }
+                case 'd':
+                    if (std::stoi(optarg) <= 0)
+                        usage();
+                    ans.deals = std::stoul(optarg);
+                    deals_set = true;
+                    break;
+                case 'f':
+                    ans.filename = optarg;
+                    break;
+                case 't':
+                    ans.type = std::stoi(optarg);
+                    if (ans.type < 1 || ans.type > 7)
+                        usage();
+                    break;
+                case 's':
+                    ans.seed = std::stoull(optarg);
+                    break;
+                case 'j':
+                    if (std::stoi(optarg) <= 0)
+                        usage();
+                    ans.threads = static_cast<unsigned>(std::stoul(optarg));
+                    break;
+                case 'b':
+                    if (std::stoi(optarg) <= 0)
+                        usage();
+                    ans.budget = std::chrono::milliseconds(std::stoi(optarg));
+                    break;
+                default:
+                    usage();
+            }
+        }
+        if (optind != argc)
+            usage();
+        if (!ans.filename.empty() && !deals_set)
+            ans.deals = 0; // the whole file
+        if (ans.threads == 0)
+            ans.threads = std::max(1u, std::thread::hardware_concurrency());
+        return ans;
+    }
+
+    uint64_t splitmix64(uint64_t x) noexcept {
+        x += 0x9E3779B97F4A7C15;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+        return x ^ (x >> 31);
+    }
+
+    // deal i depends only on the seed, not on which thread plays it
+    Deal random_deal(uint64_t seed, uint64_t i, int type) {
+        std::mt19937_64 rng(splitmix64(seed ^ splitmix64(i)));
+        std::array<Card, 52> deck;
+        for (int suit = 0; suit < 4; suit++)
+            for (int value = 0; value < 13; value++)
+                deck[suit * 13 + value] = Card(value, suit);
+        std::shuffle(deck.begin(), deck.end(), rng);
+        Deal ans{.type = static_cast<uint8_t>(type != 0 ? type : 1 + static_cast<int>(rng() % 7)),
+                 .first = get_seat_from_index(static_cast<int>(rng() % 4)), .hands = {}};
+        for (size_t i = 0; i < deck.size(); i++)
+            ans.hands[i / 13].add(deck[i]);
+        return ans;
+    }
+
+    // Indices of the deals, a range [begin, end) per thread packed into one
+    // word. The owner takes small chunks from the front; a thread that ran
+    // out takes the back half of someone else's range.
+    class WorkQueue {
+    private:
+        static constexpr uint32_t CHUNK = 16;
+        struct alignas(64) Range {
+            std::atomic<uint64_t> bounds{0};
+        };
+        std::vector<Range> ranges;
+
+        static constexpr uint64_t pack(uint32_t begin, uint32_t end) noexcept {
+            return uint64_t{begin} << 32 | end;
+        }
+    public:
+        WorkQueue(uint32_t total, size_t threads) : ranges(threads) {
+            for (size_t i = 0; i < threads; i++)
+                ranges[i].bounds.store(pack(static_cast<uint32_t>(total * i / threads),
+                                            static_cast<uint32_t>(total * (i + 1) / threads)));
+        }
+
+        // the next chunk for thread w, false once there's no work anywhere
+        bool next(size_t w, uint32_t &begin, uint32_t &end) {
+            while (true) {
+                auto &own = ranges[w].bounds;
+                uint64_t b = own.load(std::memory_order_acquire);
+                while (static_cast<uint32_t>(b >> 32) < static_cast<uint32_t>(b)) {
+                    begin = static_cast<uint32_t>(b >> 32);
+                    end = std::min(begin + CHUNK, static_cast<uint32_t>(b));
+                    if (own.compare_exchange_weak(b, pack(end, static_cast<uint32_t>(b)), std::memory_order_acq_rel))
+                        return true;
+                }
+                if (!steal(w))
+                    return false;
+            }
+        }
+    private:
+        // only called with w's range empty, so no one else touches it
+        bool steal(size_t w) {
+            for (size_t k = 1; k < ranges.size(); k++) {
+                auto &victim = ranges[(w + k) % ranges.size()].bounds;
+                uint64_t b = victim.load(std::memory_order_acquire);
+                while (true) {
+                    const uint32_t begin = static_cast<uint32_t>(b >> 32), end = static_cast<uint32_t>(b);
+                    if (begin >= end)
+                        break;
+                    const uint32_t middle = end - (end - begin + 1) / 2;
+                    if (victim.compare_exchange_weak(b, pack(begin, middle), std::memory_order_acq_rel)) {
+                        ranges[w].bounds.store(pack(middle, end), std::memory_order_release);
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+    };
+
+    struct Stats {
+        uint64_t games = 0;
+        double points = 0;
+        double squares = 0;
+        double wins = 0; // fewest points in the game, shared on ties
+        std::array<double, 8> type_points{};
+        std::array<uint64_t, 8> type_games{};
+
+        void add(int type, int p, double win) noexcept {
+            games++;
+            points += p;
+            squares += static_cast<double>(p) * p;
+            wins += win;
+            type_points[type] += p;
+            type_games[type]++;
+        }
+
+        void merge(const Stats &other) noexcept {
+            games += other.games;
+            points += other.points;
+            squares += other.squares;
+            wins += other.wins;
+            for (int t = 1; t <= 7; t++) {
+                type_points[t] += other.type_points[t];
+                type_games[t] += other.type_games[t];
+            }
+        }
+    };
+
+    // A thread's players and their results, by strategy (not seat).
+    class Worker {
+    private:
+        std::array<std::unique_ptr<Strategy>, 4> players;
+        Situation situation;
+        Engine game;
+    public:
+        std::array<Stats, 4> stats{};
+
+        explicit Worker(const sim_config &config) {
+            for (int i = 0; i < 4; i++)
+                if (!(players[i] = make_strategy(config.strategies[i], config.budget, 1)))
+                    fatal("unknown strategy %s", config.strategies[i].c_str());
+            situation.trick.reserve(4);
+        }
+
+        // strategy i sits at seat (i + shift) % 4
+        void play(const Deal &deal, int shift) {
+            game.start_deal(deal);
+            std::array<Hand, 4> hands = deal.hands;
+            Hand played;
+            std::array<uint8_t, 4> voids{};
+            while (!game.is_deal_over()) {
+                const int trick_no = game.get_trick_no(), leader = game.get_pos();
+                const std::span<const Card> trick = game.get_trick(trick_no);
+                const int seat = (leader + static_cast<int>(trick.size())) % 4;
+                situation.type = deal.type;
+                situation.seat = seat;
+                situation.tricks_done = trick_no - 1;
+                situation.leader = leader;
+                situation.hand = hands[seat];
+                situation.played = played;
+                situation.trick.assign(trick.begin(), trick.end());
+                situation.voids = voids;
+                const int player = (seat + 4 - shift) % 4;
+                const Card c = players[player]->choose(situation);
+                if (incorrect_color(hands[seat], trick, c) || !hands[seat].remove(c))
+                    fatal("strategy %d played an illegal card %s", player + 1, std::string(c.text()).c_str());
+                if (!trick.empty() && c.get_suit() != trick[0].get_suit())
+                    voids[seat] |= static_cast<uint8_t>(1 << static_cast<int>(trick[0].get_suit()));
+                game.play(c);
+                if (game.get_trick(trick_no).size() == 4)
+                    for (const Card &t: game.get_trick(trick_no))
+                        played.add(t);
+            }
+            const auto &points = game.get_points();
+            const int best = *std::min_element(points.begin(), points.end());
+            const auto winners = static_cast<double>(std::count(points.begin(), points.end(), best));
+            for (int player = 0; player < 4; player++) {
+                const int p = points[(player + shift) % 4];
+                stats[player].add(deal.type, p, p == best ? 1 / winners : 0);
+            }
+        }
+    };
+}
+
+int main(int argc, char *argv[]) {
+    sim_config config = get_sim_config(argc, argv);
+    std::vector<Deal> file_deals;
+    if (!config.filename.empty()) {
+        try {
+            file_deals = load_deals(config.filename);
+        }
+        catch (const std::exception &e) {
+            fatal("%s", e.what());
+        }
+        if (file_deals.empty())
+            fatal("no deals in %s", config.filename.c_str());
+        if (config.deals == 0)
+            config.deals = file_deals.size();
+    }
+    if (config.deals > UINT32_MAX)
+        usage();
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (unsigned i = 0; i < config.threads; i++)
+        workers.push_back(std::make_unique<Worker>(config));
+    WorkQueue queue(static_cast<uint32_t>(config.deals), config.threads);
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned w = 0; w < config.threads; w++) {
+        threads.emplace_back([&, w] {
+            Worker &worker = *workers[w];
+            uint32_t begin, end;
+            while (queue.next(w, begin, end)) {
+                for (uint32_t i = begin; i < end; i++) {
+                    const Deal deal = file_deals.empty() ? random_deal(config.seed, i, config.type)
+                                                         : file_deals[i % file_deals.size()];
+                    for (int shift = 0; shift < 4; shift++)
+                        worker.play(deal, shift);
+                }
+            }
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::array<Stats, 4> total{};
+    for (const auto &worker: workers)
+        for (int i = 0; i < 4; i++)
+            total[i].merge(worker->stats[i]);
+    printf("%zu deals x 4 seatings on %u threads in %.2f s: %.0f deals/s\n",
+           config.deals, config.threads, seconds, static_cast<double>(config.deals) / seconds);
+    printf("%-3s %-10s %10s %8s %8s %6s", "#", "strategy", "games", "mean", "stddev", "wins");
+    for (int t = 1; t <= 7; t++)
+        printf("  type%d", t);
+    printf("\n");
+    for (int i = 0; i < 4; i++) {
+        const Stats &s = total[i];
+        const auto games = static_cast<double>(s.games);
+        const double mean = s.points / games;
+        printf("%-3d %-10s %10lu %8.2f %8.2f %5.1f%%", i + 1, config.strategies[i].c_str(),
+               static_cast<unsigned long>(s.games), mean, std::sqrt(std::max(0.0, s.squares / games - mean * mean)),
+               100 * s.wins / games);
+        for (int t = 1; t <= 7; t++) {
+            if (s.type_games[t] == 0)
+                printf("  %5s", "-");
+            else
+                printf("  %5.2f", s.type_points[t] / static_cast<double>(s.type_games[t]));
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,273 @@
+#include "strategy.h"
+
+#include <algorithm>
+#include <bit>
+#include <limits>
+#include <random>
+
+#include "rules.h"
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    constexpr uint64_t DECK = Hand::suit_mask(Suit::C) | Hand::suit_mask(Suit::D) |
+                              Hand::suit_mask(Suit::H) | Hand::suit_mask(Suit::S);
+    // rollouts between two looks at the clock
+    constexpr int ROLLOUT_BATCH = 16;
+
+    constexpr uint64_t bit(const Card &c) noexcept {
+        return uint64_t{1} << c.get_code();
+    }
+
+    constexpr Card lowest(uint64_t mask) noexcept {
+        return Card::from_code(static_cast<uint8_t>(std::countr_zero(mask)));
+    }
+
+    // cards of hand that may be played on trick
+    constexpr uint64_t legal(uint64_t hand, const Card *trick, size_t size) noexcept {
+        if (size == 0)
+            return hand;
+        uint64_t suit = hand & Hand::suit_mask(trick[0].get_suit());
+        return suit != 0 ? suit : hand;
+    }
+
+    // The heuristics on bare masks, others are the cards the other players
+    // hold. Taking the trick costs what is on the table (plus what may come
+    // after us), keeping a card risks its points and, if it's high, taking
+    // some trick later on.
+    Card heuristic(int type, int tricks_done, const Card *trick, size_t size, uint64_t hand, uint64_t others) {
+        uint64_t options = legal(hand, trick, size);
+        if (std::has_single_bit(options))
+            return lowest(options);
+        const auto &card_points = CARD_POINTS[type];
+        const float trick_cost = static_cast<float>(DEAL_POINTS[type]) / 13;
+        float on_table = TRICK_POINTS[type][tricks_done] + 0.25f * trick_cost * static_cast<float>(3 - size);
+        size_t best = 0;
+        for (size_t i = 0; i < size; i++) {
+            on_table += card_points[trick[i].get_code()];
+            if (trick[best] < trick[i])
+                best = i;
+        }
+        Card choice = lowest(options);
+        float choice_cost = std::numeric_limits<float>::max();
+        for (uint64_t rest = options; rest != 0; rest &= rest - 1) {
+            const Card c = lowest(rest);
+            const uint64_t suit = others & Hand::suit_mask(c.get_suit());
+            const int higher = std::popcount(suit & ~(2 * bit(c) - 1));
+            const int lower = std::popcount(suit & (bit(c) - 1));
+            float take; // chance of taking the trick with c
+            if (size > 0 && !(trick[best] < c))
+                take = 0;
+            else if (size == 3 || higher == 0)
+                take = 1;
+            else if (size == 0 && lower == 0)
+                take = 0.1f; // whoever follows has to go over it
+            else
+                take = 1.0f / static_cast<float>(1 + higher);
+            const float risk = 0.5f * card_points[c.get_code()] +
+                0.5f * trick_cost * static_cast<float>(lower) / static_cast<float>(1 + std::popcount(suit));
+            const float cost = take * (on_table + card_points[c.get_code()]) - risk;
+            if (cost <= choice_cost) { // ties go to the higher card
+                choice = c;
+                choice_cost = cost;
+            }
+        }
+        return choice;
+    }
+
+    uint64_t unseen(const Situation &s) noexcept {
+        uint64_t ans = DECK & ~s.hand.get_mask() & ~s.played.get_mask();
+        for (const Card &c: s.trick)
+            ans &= ~bit(c);
+        return ans;
+    }
+
+    // cards each player still holds
+    std::array<int, 4> hand_sizes(const Situation &s) noexcept {
+        std::array<int, 4> ans{};
+        ans.fill(13 - s.tricks_done);
+        for (size_t i = 0; i < s.trick.size(); i++)
+            ans[(s.leader + i) % 4]--;
+        return ans;
+    }
+
+    // deals the unseen cards to the others at random, keeping their hand
+    // sizes and (unless it fails a few times) the suits they don't have
+    void determinize(const Situation &s, std::mt19937_64 &rng, std::array<uint64_t, 4> &hands) {
+        constexpr int ATTEMPTS = 8;
+        std::array<Card, 52> cards;
+        size_t n = 0;
+        for (uint64_t rest = unseen(s); rest != 0; rest &= rest - 1)
+            cards[n++] = lowest(rest);
+        for (int attempt = 0; attempt <= ATTEMPTS; attempt++) {
+            const bool voids = attempt < ATTEMPTS;
+            std::shuffle(cards.begin(), cards.begin() + static_cast<ssize_t>(n), rng);
+            std::array<int, 4> left = hand_sizes(s);
+            left[s.seat] = 0;
+            hands = {};
+            hands[s.seat] = s.hand.get_mask();
+            size_t i = 0;
+            for (; i < n; i++) {
+                // anyone who may hold the card, weighted by the cards they lack
+                const int suit = static_cast<int>(cards[i].get_suit());
+                std::array<int, 4> weight{};
+                int total = 0;
+                for (int p = 0; p < 4; p++) {
+                    if (left[p] > 0 && !(voids && (s.voids[p] >> suit & 1)))
+                        weight[p] = left[p];
+                    total += weight[p];
+                }
+                if (total == 0)
+                    break;
+                int r = std::uniform_int_distribution<int>(0, total - 1)(rng);
+                int p = 0;
+                while (r >= weight[p])
+                    r -= weight[p++];
+                hands[p] |= bit(cards[i]);
+                left[p]--;
+            }
+            if (i == n)
+                return;
+        }
+    }
+
+    // plays the deal out with the heuristics, returns the points seat takes
+    int playout(int type, int tricks_done, int leader, std::array<Card, 4> trick, size_t size,
+                std::array<uint64_t, 4> hands, int seat) {
+        int ans = 0;
+        for (; tricks_done < 13; tricks_done++) {
+            for (; size < 4; size++) {
+                const int p = (leader + static_cast<int>(size)) % 4;
+                const uint64_t others = (hands[0] | hands[1] | hands[2] | hands[3]) & ~hands[p];
+                trick[size] = heuristic(type, tricks_done, trick.data(), size, hands[p], others);
+                hands[p] &= ~bit(trick[size]);
+            }
+            leader = (leader + trick_winner(trick.data())) % 4;
+            if (leader == seat) {
+                ans += TRICK_POINTS[type][tricks_done];
+                for (const Card &c: trick)
+                    ans += CARD_POINTS[type][c.get_code()];
+            }
+            size = 0;
+        }
+        return ans;
+    }
+}
+
+// LOWEST
+
+Card LowestStrategy::choose(const Situation &s) {
+    return lowest(legal(s.hand.get_mask(), s.trick.data(), s.trick.size()));
+}
+
+// HEURISTIC
+
+Card HeuristicStrategy::choose(const Situation &s) {
+    return heuristic(s.type, s.tricks_done, s.trick.data(), s.trick.size(), s.hand.get_mask(), unseen(s));
+}
+
+// MONTE CARLO
+
+MonteCarloStrategy::MonteCarloStrategy(std::chrono::milliseconds budget, unsigned threads) : budget(budget) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    std::random_device seed;
+    for (unsigned i = 0; i < threads; i++)
+        workers.emplace_back(&MonteCarloStrategy::work, this, seed());
+}
+
+MonteCarloStrategy::~MonteCarloStrategy() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv_start.notify_all();
+    for (std::thread &t: workers)
+        t.join();
+}
+
+Card MonteCarloStrategy::choose(const Situation &s) {
+    uint64_t options = legal(s.hand.get_mask(), s.trick.data(), s.trick.size());
+    if (std::has_single_bit(options))
+        return lowest(options);
+    // what we know doesn't add up (e.g. a message got lost), nothing to sample from
+    std::array<int, 4> sizes = hand_sizes(s);
+    int others = sizes[0] + sizes[1] + sizes[2] + sizes[3] - sizes[s.seat];
+    if (s.trick.size() >= 4 || sizes[s.seat] != s.hand.size() || others != std::popcount(unseen(s)))
+        return fallback.choose(s);
+    std::unique_lock<std::mutex> lock(mutex);
+    situation = s;
+    moves.clear();
+    for (uint64_t rest = options; rest != 0; rest &= rest - 1)
+        moves.push_back(lowest(rest));
+    totals.assign(moves.size(), Totals{});
+    deadline = Clock::now() + budget;
+    busy = workers.size();
+    generation++;
+    cv_start.notify_all();
+    cv_done.wait(lock, [this] { return busy == 0; });
+    size_t best = moves.size();
+    for (size_t i = 0; i < moves.size(); i++) {
+        if (totals[i].rollouts == 0)
+            continue;
+        // points / rollouts < best's points / best's rollouts
+        if (best == moves.size() ||
+            totals[i].points * totals[best].rollouts < totals[best].points * totals[i].rollouts)
+            best = i;
+    }
+    return best == moves.size() ? fallback.choose(s) : moves[best];
+}
+
+void MonteCarloStrategy::work(unsigned seed) {
+    std::mt19937_64 rng(seed);
+    uint64_t done = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv_start.wait(lock, [this, done] { return stopping || generation != done; });
+        if (stopping)
+            return;
+        done = generation;
+        const Situation s = situation;
+        const std::vector<Card> my_moves = moves;
+        const Clock::time_point end = deadline;
+        lock.unlock();
+
+        std::vector<Totals> mine(my_moves.size());
+        std::array<Card, 4> trick{};
+        std::copy(s.trick.begin(), s.trick.end(), trick.begin());
+        std::array<uint64_t, 4> hands{};
+        do {
+            for (int i = 0; i < ROLLOUT_BATCH; i++) {
+                // every move is tried on the same deal of unseen cards
+                determinize(s, rng, hands);
+                for (size_t m = 0; m < my_moves.size(); m++) {
+                    std::array<uint64_t, 4> after = hands;
+                    after[s.seat] &= ~bit(my_moves[m]);
+                    trick[s.trick.size()] = my_moves[m];
+                    mine[m].points += playout(s.type, s.tricks_done, s.leader, trick, s.trick.size() + 1,
+                                              after, s.seat);
+                    mine[m].rollouts++;
+                }
+            }
+        } while (Clock::now() < end);
+
+        lock.lock();
+        for (size_t m = 0; m < mine.size(); m++) {
+            totals[m].points += mine[m].points;
+            totals[m].rollouts += mine[m].rollouts;
+        }
+        if (--busy == 0)
+            cv_done.notify_one();
+    }
+}
+
+std::unique_ptr<Strategy> make_strategy(const std::string &name, std::chrono::milliseconds budget,
+                                        unsigned threads) {
+    if (name == "lowest")
+        return std::make_unique<LowestStrategy>();
+    if (name == "heuristic")
+        return std::make_unique<HeuristicStrategy>();
+    if (name == "mc")
+        return std::make_unique<MonteCarloStrategy>(budget, threads);
+    return nullptr;
+}
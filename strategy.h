@@ -0,0 +1,90 @@
+#ifndef STRATEGY_H
+#define STRATEGY_H
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "card.h"
+
+// Everything the client has seen of the current deal, from its own seat.
+// Seats are indices (N, E, S, W = 0-3).
+struct Situation {
+    int type = 1;            // deal type, 1-7
+    int seat = 0;
+    int tricks_done = 0;
+    int leader = 0;          // who led the current trick
+    Hand hand;
+    Hand played;             // cards of the finished tricks
+    std::vector<Card> trick; // the current trick so far
+    // bit s is set if the player didn't follow suit s, so has none of it
+    std::array<uint8_t, 4> voids{};
+};
+
+// Picks the card to play. Implementations must return a legal card.
+class Strategy {
+public:
+    virtual ~Strategy() = default;
+    [[nodiscard]] virtual Card choose(const Situation &s) = 0;
+};
+
+// Lowest card of the suit led, else lowest card: the old automatic player.
+class LowestStrategy : public Strategy {
+public:
+    [[nodiscard]] Card choose(const Situation &s) override;
+};
+
+// Weighs the chance of taking the trick now against the risk of keeping
+// the card, using the points of the deal type. Cheap enough for rollouts.
+class HeuristicStrategy : public Strategy {
+public:
+    [[nodiscard]] Card choose(const Situation &s) override;
+};
+
+// Determinized Monte Carlo: deals the unseen cards at random (keeping
+// known voids), plays the deal out with the heuristics after each legal
+// card and picks the one with the fewest points on average. Rollouts run
+// on a pool of threads until the per-move budget is used up.
+class MonteCarloStrategy : public Strategy {
+private:
+    struct Totals {
+        uint64_t points = 0;
+        uint64_t rollouts = 0;
+    };
+
+    const std::chrono::milliseconds budget;
+    HeuristicStrategy fallback;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable cv_start;
+    std::condition_variable cv_done;
+    bool stopping = false;
+    uint64_t generation = 0; // of the current move
+    size_t busy = 0;         // workers still on the current move
+    // the current move, read by the workers
+    Situation situation;
+    std::vector<Card> moves;
+    std::chrono::steady_clock::time_point deadline;
+    std::vector<Totals> totals;
+
+    void work(unsigned seed);
+public:
+    // threads == 0 means one per hardware thread
+    MonteCarloStrategy(std::chrono::milliseconds budget, unsigned threads);
+    ~MonteCarloStrategy() override;
+    MonteCarloStrategy(const MonteCarloStrategy &) = delete;
+    MonteCarloStrategy &operator=(const MonteCarloStrategy &) = delete;
+    [[nodiscard]] Card choose(const Situation &s) override;
+};
+
+// "lowest", "heuristic" or "mc", nullptr for an unknown name
+std::unique_ptr<Strategy> make_strategy(const std::string &name, std::chrono::milliseconds budget,
+                                        unsigned threads);
+
+#endif //STRATEGY_H
@@ -0,0 +1,95 @@
+#include "trace.h"
+
+#ifdef KIERKI_TRACE
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "err.h"
+
+namespace {
+    // All the rings created, the most threads alive at once. They outlive
+    // their threads, so spans of finished connections still make it into
+    // the dump unless a new thread has overwritten them.
+    class Registry {
+    private:
+        std::mutex mutex;
+        std::vector<std::unique_ptr<trace::Ring>> rings;
+        std::vector<trace::Ring *> free; // of finished threads
+    public:
+        trace::Ring &acquire() {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (rings.empty())
+                std::atexit([] { registry().dump(); });
+            trace::Ring *ring;
+            if (free.empty()) {
+                rings.push_back(std::make_unique<trace::Ring>());
+                ring = rings.back().get();
+            }
+            else {
+                ring = free.back();
+                free.pop_back();
+            }
+            ring->tid = gettid();
+            return *ring;
+        }
+
+        void release(trace::Ring &ring) {
+            std::unique_lock<std::mutex> lock(mutex);
+            free.push_back(&ring);
+        }
+
+        void dump() {
+            std::unique_lock<std::mutex> lock(mutex);
+            const char *dir = std::getenv("KIERKI_TRACE_DIR");
+            std::string path = std::string(dir != nullptr ? dir : ".") + "/kierki-trace-" +
+                               std::to_string(getpid()) + ".json";
+            FILE *file = std::fopen(path.c_str(), "w");
+            if (file == nullptr) {
+                error("cannot write the trace to %s", path.c_str());
+                return;
+            }
+            const int pid = getpid();
+            bool first = true;
+            std::fputs("{\"traceEvents\":[\n", file);
+            for (const auto &ring: rings) {
+                ring->for_each([&](const trace::Ring::Entry &e) {
+                    std::fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                                 first ? "" : ",\n", e.name, static_cast<double>(e.begin) / 1000,
+                                 static_cast<double>(e.end - e.begin) / 1000, pid, e.tid);
+                    first = false;
+                });
+            }
+            std::fputs("\n],\"displayTimeUnit\":\"ns\"}\n", file);
+            std::fclose(file);
+        }
+
+        // never destroyed: threads still running at exit give their rings back
+        static Registry &registry() {
+            static auto *instance = new Registry;
+            return *instance;
+        }
+    };
+}
+
+trace::Ring &trace::local_ring() {
+    // gives the ring back to the pool when the thread exits
+    struct Owner {
+        Ring *ring = nullptr;
+        ~Owner() {
+            if (ring != nullptr)
+                Registry::registry().release(*ring);
+        }
+    };
+    thread_local Owner owner;
+    if (owner.ring == nullptr)
+        owner.ring = &Registry::registry().acquire();
+    return *owner.ring;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Spans of the hot paths, switched on at compile time (make TRACE=1).
+// Each thread records into its own ring, which keeps the latest spans. A
+// thread's ring goes back to a pool when it exits and the next thread
+// continues it, so there are as many rings as threads alive at once (a
+// thread per player reconnecting doesn't add any). All the rings are
+// written on exit as Chrome trace events (JSON, loads in
+// chrome://tracing and Perfetto) to kierki-trace-<pid>.json in
+// $KIERKI_TRACE_DIR or the working directory. Without TRACE the macro
+// expands to nothing.
+
+#ifdef KIERKI_TRACE
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+namespace trace {
+    [[nodiscard]] inline uint64_t now_ns() noexcept {
+        timespec t{};
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return static_cast<uint64_t>(t.tv_sec) * 1'000'000'000 + static_cast<uint64_t>(t.tv_nsec);
+    }
+
+    // Spans of a single thread at a time. Only that thread writes, the dump
+    // reads the spans published by count.
+    class Ring {
+    public:
+        static constexpr size_t CAPACITY = 1 << 14; // must be a power of 2
+        struct Entry {
+            const char *name;
+            uint64_t begin;
+            uint64_t end;
+            int tid; // of the thread that recorded it
+        };
+    private:
+        std::array<Entry, CAPACITY> spans;
+        std::atomic<uint64_t> count{0};
+    public:
+        int tid = 0; // of the thread using it
+
+        void record(const char *name, uint64_t begin, uint64_t end) noexcept {
+            uint64_t n = count.load(std::memory_order_relaxed);
+            spans[n & (CAPACITY - 1)] = {name, begin, end, tid};
+            count.store(n + 1, std::memory_order_release);
+        }
+
+        // calls f on the spans kept, oldest first
+        template <class F>
+        void for_each(F f) const {
+            uint64_t n = count.load(std::memory_order_acquire);
+            for (uint64_t i = n > CAPACITY ? n - CAPACITY : 0; i < n; i++)
+                f(spans[i & (CAPACITY - 1)]);
+        }
+    };
+
+    // the calling thread's ring, taken from the pool on first use
+    Ring &local_ring();
+
+    // Records the time between its construction and destruction.
+    class Span {
+    private:
+        const char *const name;
+        const uint64_t begin;
+    public:
+        explicit Span(const char *name) noexcept : name(name), begin(now_ns()) {}
+        Span(const Span &) = delete;
+        Span &operator=(const Span &) = delete;
+        ~Span() {
+            local_ring().record(name, begin, now_ns());
+        }
+    };
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// traces the rest of the enclosing scope, name must be a string literal
+#define TRACE_SPAN(name) trace::Span TRACE_CONCAT(trace_span_, __LINE__)(name)
+
+#else
+
+#define TRACE_SPAN(name) static_cast<void>(0)
+
+#endif
+
+#endif //TRACE_H